@@ -0,0 +1,153 @@
+/*
+ * Generates the synthetic allocation traces in bench/traces, in the format read by replay.c.
+ *
+ * Usage: gentrace <binary-tree|bursty|realloc-heavy|random-size> [seed] > trace.rep
+ *
+ * Every trace keeps its live payload under LIVE_MAX bytes, so that it can be replayed in heap 0,
+ * which sfutil limits to a few dozen kilobytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define LIVE_MAX 14000
+#define MAX_IDS 4096
+
+static size_t sizes[MAX_IDS];
+static int live[MAX_IDS];
+static size_t liveBytes = 0;
+static long ops = 0;
+
+static void alloc(int id, size_t size) {
+    printf("a %d %zu\n", id, size);
+    sizes[id] = size;
+    live[id] = 1;
+    liveBytes += size;
+    ops++;
+}
+
+static void resize(int id, size_t size) {
+    printf("r %d %zu\n", id, size);
+    liveBytes += size - sizes[id];
+    sizes[id] = size;
+    ops++;
+}
+
+static void release(int id) {
+    printf("f %d\n", id);
+    live[id] = 0;
+    liveBytes -= sizes[id];
+    ops++;
+}
+
+// Random size between lo and hi, uniform on a log scale
+static size_t logUniform(size_t lo, size_t hi) {
+    return (size_t)exp(log(lo) + (log(hi + 1) - log(lo)) * (rand() / (RAND_MAX + 1.0)));
+}
+
+// Nodes of a binary tree, built depth first and freed in post-order, like a parser's syntax trees
+static int nextNode;
+static int buildTree(int depth) {
+    int id = nextNode++;
+    alloc(id, 24 + 8 * (rand() % 4));
+    if (depth > 0) {
+        buildTree(depth - 1);
+        buildTree(depth - 1);
+    }
+    return id;
+}
+
+static void freeTree(int id, int depth) {
+    if (depth > 0) {
+        freeTree(id + 1, depth - 1);
+        freeTree(id + (1 << depth), depth - 1);
+    }
+    release(id);
+}
+
+static void binaryTree(void) {
+    for (int round = 0; round < 120; round++) {
+        // Two trees at once, so that the second one's nodes are freed while the first one is still being torn down
+        int depth1 = 4 + rand() % 4, depth2 = 3 + rand() % 4;
+        nextNode = 0;
+        int first = buildTree(depth1);
+        int second = buildTree(depth2);
+        freeTree(first, depth1);
+        freeTree(second, depth2);
+    }
+}
+
+static void bursty(void) {
+    // A few long-lived objects, then bursts of short-lived ones of which only some survive to the next burst
+    for (int id = 0; id < 20; id++) alloc(id, logUniform(16, 200));
+    for (int burst = 0; burst < 300; burst++) {
+        int count = 20 + rand() % 120;
+        for (int i = 0; i < count; i++) {
+            int id = 20 + rand() % (MAX_IDS - 20);
+            size_t size = logUniform(16, 512);
+            if (live[id] || liveBytes + size > LIVE_MAX) continue;
+            alloc(id, size);
+        }
+        for (int id = 20; id < MAX_IDS; id++) {
+            if (live[id] && rand() % 10 != 0) release(id);
+        }
+    }
+    for (int id = 0; id < MAX_IDS; id++) {
+        if (live[id]) release(id);
+    }
+}
+
+static void reallocHeavy(void) {
+    // Growing buffers (log records, arrays), appended to in small steps and occasionally thrown away
+    int buffers = 12;
+    for (int id = 0; id < buffers; id++) alloc(id, 1 + rand() % 32);
+    for (int step = 0; step < 20000; step++) {
+        int id = rand() % buffers;
+        size_t size = sizes[id] + 1 + rand() % 48;
+        if (size > 2000 || liveBytes + size - sizes[id] > LIVE_MAX) {
+            release(id);
+            alloc(id, 1 + rand() % 32);
+        }
+        else {
+            resize(id, size);
+        }
+    }
+    for (int id = 0; id < buffers; id++) release(id);
+}
+
+static void randomSize(void) {
+    // Random allocations and frees of sizes spread over three orders of magnitude
+    int ids = 400;
+    for (int step = 0; step < 30000; step++) {
+        int id = rand() % ids;
+        if (live[id]) {
+            release(id);
+            continue;
+        }
+        size_t size = logUniform(1, 1500);
+        if (liveBytes + size <= LIVE_MAX) alloc(id, size);
+    }
+    for (int id = 0; id < ids; id++) {
+        if (live[id]) release(id);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <binary-tree|bursty|realloc-heavy|random-size> [seed]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+    printf("# %s, generated by gentrace\n", argv[1]);
+    if (strcmp(argv[1], "binary-tree") == 0) binaryTree();
+    else if (strcmp(argv[1], "bursty") == 0) bursty();
+    else if (strcmp(argv[1], "realloc-heavy") == 0) reallocHeavy();
+    else if (strcmp(argv[1], "random-size") == 0) randomSize();
+    else {
+        fprintf(stderr, "unknown trace %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "%s: %ld ops\n", argv[1], ops);
+    return EXIT_SUCCESS;
+}
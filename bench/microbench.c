@@ -0,0 +1,377 @@
+/*
+ * Per-operation microbenchmarks of sf_malloc, sf_free, sf_realloc and sf_memalign, broken down by block size and by the
+ * path that the operation takes through the allocator.
+ *
+ * Usage: sfmm_microbench [-n operations] [-r repetitions] [-c tcache count] [benchmark...]
+ *
+ *     malloc/free-list     Every request is served by a free block of the same size, found in the free lists
+ *     malloc/wilderness    There are no free blocks, and every request is split off a large wilderness block
+ *     malloc/growth        The wilderness block is used up, so the heap grows (by SF_OPT_GROW_CHUNK) as needed
+ *     free/no-coalesce     Every freed block is between two allocated blocks
+ *     free/coalesce        The blocks are freed in address order, so that every one coalesces w/ the one before it
+ *     realloc/shrink       Every block is shrunk to half its size, in place
+ *     realloc/grow-in-place  Every block is grown into the free block that follows it
+ *     realloc/move         Every block is grown, and has to be moved as the block after it is allocated
+ *     memalign/64, memalign/4096  Every request is aligned, and split off a large wilderness block
+ *     arena/alloc          Every request is bumped from a chunk of an arena that was used and reset before, and the
+ *                          arena is reset after the batch (compare w/ malloc/wilderness plus free/coalesce)
+ *     pool/alloc           Every request is served by an object on the free list of a pool (compare w/ malloc/free-list)
+ *     pool/free            Every object is given back to its pool (compare w/ free/no-coalesce)
+ *
+ * Every benchmark sets up the heap for its path, and then times a batch of operations of one kind. The batch is
+ * repeated, and the fastest repetition is reported. Besides ns/op, the hardware counters for cycles, instructions,
+ * cache misses and branch misses per op are read through perf_event_open, when the kernel allows it (see
+ * /proc/sys/kernel/perf_event_paranoid). Only user space is counted, so page faults do not show up in the counters.
+ *
+ * The benchmarks run in heap 1, as sfutil limits heap 0 to a few dozen kilobytes. The heap is emptied and trimmed
+ * after every repetition.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "sfmm_ext.h"
+
+#define COUNTERS 4
+#define SEPARATOR_SIZE 24                           // Keeps blocks from coalescing w/ each other
+
+static const size_t sizes[] = {24, 120, 248, 504, 1016, 4088};
+
+static struct sf_arena* arena;                      // The arena of arena/alloc, destroyed after every repetition
+static struct sf_pool* pool;                        // The pool of the pool/ benchmarks, destroyed after every repetition
+
+typedef struct {
+    double ns;
+    double counts[COUNTERS];
+} op_cost;
+
+typedef struct {
+    const char* name;
+    // Prepare blocks[] and the heap for a batch of n operations on blocks of the given size
+    void (*setup)(void** blocks, void** extra, int n, size_t size);
+    // The timed batch
+    void (*run)(void** blocks, int n, size_t size);
+} benchmark;
+
+static int counterGroup = -1;                      // perf_event_open group leader, or -1 if counters are not available
+static int counterFds[COUNTERS];
+static const char* counterNames[COUNTERS] = {"cycles", "instr", "cache-miss", "branch-miss"};
+static const unsigned long long counterConfigs[COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Counters -----------------------------------------------------------------------------------------------------------
+
+static void openCounters(void) {
+    for (int i = 0; i < COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = counterConfigs[i];
+        attr.disabled = (i == 0);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        counterFds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : counterGroup, 0);
+        if (counterFds[i] == -1) {
+            for (int j = 0; j < i; j++) close(counterFds[j]);
+            counterGroup = -1;
+            return;
+        }
+        if (i == 0) counterGroup = counterFds[0];
+    }
+}
+
+static void startCounters(void) {
+    if (counterGroup == -1) return;
+    ioctl(counterGroup, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counterGroup, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void stopCounters(double* counts) {
+    if (counterGroup == -1) return;
+    ioctl(counterGroup, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    unsigned long long values[1 + COUNTERS];
+    if (read(counterGroup, values, sizeof(values)) != sizeof(values)) return;
+    for (int i = 0; i < COUNTERS; i++) {
+        counts[i] = values[1 + i];
+    }
+}
+
+// Setups -------------------------------------------------------------------------------------------------------------
+
+// Make the wilderness block large enough for what the batch will allocate, so that the heap does not grow while timed.
+// Its pages are touched, so that page faults are not timed either.
+static void growWildernessFor(int n, size_t size) {
+    size_t bytes = (size_t)n * (size + 64) + 4096;
+    void* p = sf_malloc(bytes);
+    if (p == NULL) return;
+    memset(p, 0, bytes);
+    sf_free(p);
+}
+
+static void setupNothing(void** blocks, void** extra, int n, size_t size) {
+}
+
+static void setupWilderness(void** blocks, void** extra, int n, size_t size) {
+    growWildernessFor(n, size);
+}
+
+// Room for the padding that aligned blocks are carved from, as well
+static void setupAlignedWilderness(void** blocks, void** extra, int n, size_t size) {
+    growWildernessFor(n, size + 4096);
+}
+
+// n blocks, each followed by an allocated separator, w/ room left for n blocks twice the size
+static void setupSeparated(void** blocks, void** extra, int n, size_t size) {
+    growWildernessFor(4 * n, size);
+    for (int i = 0; i < n; i++) {
+        blocks[i] = sf_malloc(size);
+        extra[i] = sf_malloc(SEPARATOR_SIZE);
+    }
+}
+
+// n free blocks of the given size, in the free lists
+static void setupFreeBlocks(void** blocks, void** extra, int n, size_t size) {
+    setupSeparated(blocks, extra, n, size);
+    for (int i = 0; i < n; i++) {
+        sf_free(blocks[i]);
+    }
+    growWildernessFor(n, size);
+}
+
+// n adjacent blocks, followed by an allocated separator
+static void setupAdjacent(void** blocks, void** extra, int n, size_t size) {
+    growWildernessFor(n, size);
+    for (int i = 0; i < n; i++) {
+        blocks[i] = sf_malloc(size);
+    }
+    extra[0] = sf_malloc(SEPARATOR_SIZE);
+}
+
+// n blocks, each followed by a free block of the same size and an allocated separator
+static void setupGaps(void** blocks, void** extra, int n, size_t size) {
+    growWildernessFor(3 * n, size);
+    for (int i = 0; i < n; i++) {
+        blocks[i] = sf_malloc(size);
+        void* gap = sf_malloc(size);
+        extra[i] = sf_malloc(SEPARATOR_SIZE);
+        sf_free(gap);
+    }
+}
+
+// An arena that has already allocated a batch like the timed one, and was reset
+static void setupArena(void** blocks, void** extra, int n, size_t size) {
+    arena = sf_arena_create(0);
+    for (int i = 0; i < n; i++) {
+        sf_arena_alloc(arena, size, 0);
+    }
+    sf_arena_reset(arena);
+}
+
+// n objects allocated from a pool of objects of the given size
+static void setupPoolObjects(void** blocks, void** extra, int n, size_t size) {
+    pool = sf_pool_create(size, 0);
+    for (int i = 0; i < n; i++) {
+        blocks[i] = sf_pool_alloc(pool);
+    }
+}
+
+// n objects on the free list of a pool
+static void setupPoolFreeList(void** blocks, void** extra, int n, size_t size) {
+    setupPoolObjects(blocks, extra, n, size);
+    for (int i = 0; i < n; i++) {
+        sf_pool_free(pool, blocks[i]);
+        blocks[i] = NULL;
+    }
+}
+
+// Runs ---------------------------------------------------------------------------------------------------------------
+
+static void runMalloc(void** blocks, int n, size_t size) {
+    for (int i = 0; i < n; i++) {
+        blocks[i] = sf_malloc(size);
+    }
+}
+
+static void runFree(void** blocks, int n, size_t size) {
+    for (int i = 0; i < n; i++) {
+        sf_free(blocks[i]);
+        blocks[i] = NULL;
+    }
+}
+
+static void runShrink(void** blocks, int n, size_t size) {
+    for (int i = 0; i < n; i++) {
+        blocks[i] = sf_realloc(blocks[i], size / 2);
+    }
+}
+
+static void runGrow(void** blocks, int n, size_t size) {
+    for (int i = 0; i < n; i++) {
+        blocks[i] = sf_realloc(blocks[i], 2 * size);
+    }
+}
+
+static void runMemalign64(void** blocks, int n, size_t size) {
+    for (int i = 0; i < n; i++) {
+        blocks[i] = sf_memalign(size, 64);
+    }
+}
+
+static void runMemalign4096(void** blocks, int n, size_t size) {
+    for (int i = 0; i < n; i++) {
+        blocks[i] = sf_memalign(size, 4096);
+    }
+}
+
+// The blocks are not kept, as they cannot be given to sf_free
+static void runArenaAlloc(void** blocks, int n, size_t size) {
+    for (int i = 0; i < n; i++) {
+        if (sf_arena_alloc(arena, size, 0) == NULL) break;
+    }
+    sf_arena_reset(arena);
+}
+
+static void runPoolAlloc(void** blocks, int n, size_t size) {
+    for (int i = 0; i < n; i++) {
+        blocks[i] = sf_pool_alloc(pool);
+    }
+}
+
+static void runPoolFree(void** blocks, int n, size_t size) {
+    for (int i = 0; i < n; i++) {
+        sf_pool_free(pool, blocks[i]);
+        blocks[i] = NULL;
+    }
+}
+
+static const benchmark benchmarks[] = {
+    {"malloc/free-list", setupFreeBlocks, runMalloc},
+    {"malloc/wilderness", setupWilderness, runMalloc},
+    {"malloc/growth", setupNothing, runMalloc},
+    {"free/no-coalesce", setupSeparated, runFree},
+    {"free/coalesce", setupAdjacent, runFree},
+    {"realloc/shrink", setupSeparated, runShrink},
+    {"realloc/grow-in-place", setupGaps, runGrow},
+    {"realloc/move", setupSeparated, runGrow},
+    {"memalign/64", setupAlignedWilderness, runMemalign64},
+    {"memalign/4096", setupAlignedWilderness, runMemalign4096},
+    {"arena/alloc", setupArena, runArenaAlloc},
+    {"pool/alloc", setupPoolFreeList, runPoolAlloc},
+    {"pool/free", setupPoolObjects, runPoolFree},
+};
+
+// Free everything that a repetition left allocated, and give the heap back to the OS, so that the next one starts over
+static void empty(void** blocks, void** extra, int n) {
+    for (int i = 0; i < n; i++) {
+        if (blocks[i] != NULL && pool != NULL) sf_pool_free(pool, blocks[i]);
+        else if (blocks[i] != NULL) sf_free(blocks[i]);
+        if (extra[i] != NULL) sf_free(extra[i]);
+        blocks[i] = NULL;
+        extra[i] = NULL;
+    }
+    sf_arena_destroy(arena);
+    arena = NULL;
+    sf_pool_destroy(pool);
+    pool = NULL;
+    sf_trim(0);
+}
+
+static op_cost measure(const benchmark* bench, size_t size, int n, int repetitions, void** blocks, void** extra) {
+    op_cost best;
+    best.ns = -1;
+    for (int r = 0; r < repetitions; r++) {
+        op_cost cost;
+        memset(&cost, 0, sizeof(cost));
+        bench->setup(blocks, extra, n, size);
+        startCounters();
+        double start = now();
+        bench->run(blocks, n, size);
+        double elapsed = now() - start;
+        stopCounters(cost.counts);
+        empty(blocks, extra, n);
+
+        cost.ns = elapsed * 1e9 / n;
+        for (int i = 0; i < COUNTERS; i++) {
+            cost.counts[i] /= n;
+        }
+        if (best.ns < 0 || cost.ns < best.ns) best = cost;
+    }
+    return best;
+}
+
+// Allocate once, so that the thread that calls this is bound to heap 0 and the main thread is left to bind to heap 1
+static void* claimHeapZero(void* arg) {
+    sf_free(sf_malloc(1));
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    int n = 2000;
+    int repetitions = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:c:")) != -1) {
+        if (opt == 'n') n = atoi(optarg);
+        else if (opt == 'r') repetitions = atoi(optarg);
+        else if (opt == 'c') sf_mallopt(SF_OPT_TCACHE_COUNT, atoi(optarg));
+        else {
+            fprintf(stderr, "usage: %s [-n operations] [-r repetitions] [-c tcache count] [benchmark...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (n < 1 || repetitions < 1) {
+        fprintf(stderr, "usage: %s [-n operations] [-r repetitions] [-c tcache count] [benchmark...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    sf_set_heap_count(2);
+    pthread_t thread;
+    pthread_create(&thread, NULL, claimHeapZero, NULL);
+    pthread_join(thread, NULL);
+    openCounters();
+    if (counterGroup == -1) fprintf(stderr, "hardware counters are not available, only ns/op is reported\n");
+
+    void** blocks = calloc(n, sizeof(void*));
+    void** extra = calloc(n, sizeof(void*));
+    printf("%-22s %6s %9s", "benchmark", "size", "ns/op");
+    for (int i = 0; i < COUNTERS; i++) {
+        printf(" %11s", counterNames[i]);
+    }
+    printf("\n");
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        const benchmark* bench = &benchmarks[b];
+        if (optind < argc) {
+            int selected = 0;
+            for (int i = optind; i < argc; i++) {
+                if (strncmp(argv[i], bench->name, strlen(argv[i])) == 0) selected = 1;
+            }
+            if (!selected) continue;
+        }
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            op_cost cost = measure(bench, sizes[s], n, repetitions, blocks, extra);
+            printf("%-22s %6zu %9.1f", bench->name, sizes[s], cost.ns);
+            for (int i = 0; i < COUNTERS; i++) {
+                if (counterGroup == -1) printf(" %11s", "-");
+                else printf(" %11.1f", cost.counts[i]);
+            }
+            printf("\n");
+        }
+    }
+    free(blocks);
+    free(extra);
+    return EXIT_SUCCESS;
+}
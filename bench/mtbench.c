@@ -0,0 +1,334 @@
+/*
+ * Multithreaded stress benchmarks, run against sf_malloc/sf_free and against the C library's malloc/free for reference.
+ *
+ * Usage: sfmm_mtbench [-n operations] [-c tcache count] [benchmark...]
+ *
+ *     larson           Every thread keeps an array of blocks of random sizes, and replaces random ones. After every
+ *                      round, each thread takes over the array of the next thread, so most blocks are freed by a
+ *                      thread other than the one that allocated them.
+ *     xmalloc          Every thread allocates batches of blocks and hands them to the next thread, which frees them
+ *                      (producer/consumer cross-thread frees).
+ *     cache-scratch    Every thread is handed one small block allocated by the main thread, frees it, and then
+ *                      repeatedly allocates, writes and frees a small block. An allocator that gives blocks of
+ *                      different threads the same cache line makes the writes slow (active false sharing).
+ *
+ * Every benchmark is run w/ 1, 2, 4 and 8 threads, and w/ as many threads as there are processors, each in a child
+ * process of its own. The operations are split evenly between the threads. For sf_malloc, the main thread is bound to
+ * heap 0 and every worker thread gets a heap of its own, up to SF_MAX_HEAPS - 1 threads. The report gives throughput
+ * (operations per second, over all threads) and the peak resident set size of the child.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "sfmm_ext.h"
+
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 20
+#define LARSON_MIN_SIZE 8
+#define LARSON_MAX_SIZE 1000
+#define XMALLOC_BATCH 64
+#define XMALLOC_QUEUE 16                            // Batches waiting in the inbox of a thread
+#define XMALLOC_SIZE 64
+#define SCRATCH_SIZE 8
+#define SCRATCH_WRITES 50
+
+typedef struct {
+    const char* name;
+    void* (*malloc)(size_t);
+    void (*free)(void*);
+} allocator;
+
+typedef struct {
+    double opsPerSecond;
+    long maxRssKb;
+} bench_result;
+
+typedef struct thread_args thread_args;
+
+typedef struct {
+    const char* name;
+    void (*setup)(thread_args* args, int threads);  // Runs in the main thread, before the worker threads start
+    void* (*run)(void* args);                       // Runs in every worker thread
+} benchmark;
+
+struct thread_args {
+    int index;
+    int threads;
+    long ops;                                       // Operations for this thread
+    const allocator* alloc;
+    thread_args* all;                               // The arguments of every thread, indexed by thread
+    pthread_barrier_t* barrier;
+    unsigned long long seed;
+    void** slots;                                   // larson: the array this thread works on
+    void* handed;                                   // cache-scratch: the block allocated by the main thread
+    // xmalloc: the inbox of this thread
+    pthread_mutex_t lock;
+    void** queue[XMALLOC_QUEUE];
+    int queued;
+};
+
+static int tcacheCount = 0;
+
+static void freeSf(void* p) {
+    if (p != NULL) sf_free(p);
+}
+
+static const allocator allocators[] = {
+    {"sf_malloc", sf_malloc, freeSf},
+    {"glibc", malloc, free},
+};
+
+// xorshift64*, as rand() is neither fast nor thread-safe enough to use in the benchmarks
+static unsigned long long nextRandom(unsigned long long* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Larson -------------------------------------------------------------------------------------------------------------
+
+static void larsonSetup(thread_args* args, int threads) {
+    for (int i = 0; i < threads; i++) {
+        args[i].slots = calloc(LARSON_SLOTS, sizeof(void*));
+    }
+}
+
+static void* larsonRun(void* p) {
+    thread_args* args = p;
+    const allocator* alloc = args->alloc;
+    long perRound = args->ops / (2 * LARSON_ROUNDS);    // Every replacement is a free and a malloc
+    for (int i = 0; i < LARSON_SLOTS; i++) {
+        args->slots[i] = alloc->malloc(LARSON_MIN_SIZE + nextRandom(&args->seed) % (LARSON_MAX_SIZE - LARSON_MIN_SIZE));
+    }
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        void** slots = args->slots;
+        for (long i = 0; i < perRound; i++) {
+            unsigned long long r = nextRandom(&args->seed);
+            int slot = r % LARSON_SLOTS;
+            alloc->free(slots[slot]);
+            slots[slot] = alloc->malloc(LARSON_MIN_SIZE + (r >> 32) % (LARSON_MAX_SIZE - LARSON_MIN_SIZE));
+            ((char*)slots[slot])[0] = (char)i;
+        }
+        // Take over the array of the next thread, so that its blocks are freed here
+        pthread_barrier_wait(args->barrier);
+        void** next = args->all[(args->index + 1) % args->threads].slots;
+        pthread_barrier_wait(args->barrier);
+        args->slots = next;
+    }
+    for (int i = 0; i < LARSON_SLOTS; i++) {
+        alloc->free(args->slots[i]);
+    }
+    return NULL;
+}
+
+// xmalloc ------------------------------------------------------------------------------------------------------------
+
+static int producing;                               // xmalloc: the number of threads that are still producing
+
+static void xmallocSetup(thread_args* args, int threads) {
+    producing = threads;
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&args[i].lock, NULL);
+        args[i].queued = 0;
+    }
+}
+
+// Free every block of a batch taken from the inbox, if there is one
+static void xmallocConsume(thread_args* args) {
+    pthread_mutex_lock(&args->lock);
+    void** batch = args->queued > 0 ? args->queue[--args->queued] : NULL;
+    pthread_mutex_unlock(&args->lock);
+    if (batch == NULL) return;
+    for (int i = 0; i < XMALLOC_BATCH; i++) {
+        args->alloc->free(batch[i]);
+    }
+    args->alloc->free(batch);
+}
+
+static void* xmallocRun(void* p) {
+    thread_args* args = p;
+    const allocator* alloc = args->alloc;
+    thread_args* consumer = &args->all[(args->index + 1) % args->threads];
+    long batches = args->ops / (2 * XMALLOC_BATCH);
+    for (long b = 0; b < batches; b++) {
+        void** batch = alloc->malloc(XMALLOC_BATCH * sizeof(void*));
+        for (int i = 0; i < XMALLOC_BATCH; i++) {
+            batch[i] = alloc->malloc(XMALLOC_SIZE);
+            ((char*)batch[i])[0] = (char)i;
+        }
+        // Free what others have produced while the inbox of the consumer is full
+        pthread_mutex_lock(&consumer->lock);
+        while (consumer->queued == XMALLOC_QUEUE) {
+            pthread_mutex_unlock(&consumer->lock);
+            if (args->queued == 0) sched_yield();
+            xmallocConsume(args);
+            pthread_mutex_lock(&consumer->lock);
+        }
+        consumer->queue[consumer->queued++] = batch;
+        pthread_mutex_unlock(&consumer->lock);
+        xmallocConsume(args);
+    }
+    // Keep freeing what is left in the inbox until every thread is done producing, as some may be waiting for room in it
+    __atomic_sub_fetch(&producing, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&producing, __ATOMIC_ACQUIRE) > 0 || args->queued > 0) {
+        if (args->queued == 0) sched_yield();
+        xmallocConsume(args);
+    }
+    return NULL;
+}
+
+// cache-scratch ------------------------------------------------------------------------------------------------------
+
+static void scratchSetup(thread_args* args, int threads) {
+    for (int i = 0; i < threads; i++) {
+        args[i].handed = args[i].alloc->malloc(SCRATCH_SIZE);
+    }
+}
+
+static void* scratchRun(void* p) {
+    thread_args* args = p;
+    const allocator* alloc = args->alloc;
+    alloc->free(args->handed);
+    long iterations = args->ops / 2;
+    for (long i = 0; i < iterations; i++) {
+        volatile char* block = alloc->malloc(SCRATCH_SIZE);
+        for (int w = 0; w < SCRATCH_WRITES; w++) {
+            block[w % SCRATCH_SIZE]++;
+        }
+        alloc->free((void*)block);
+    }
+    return NULL;
+}
+
+static const benchmark benchmarks[] = {
+    {"larson", larsonSetup, larsonRun},
+    {"xmalloc", xmallocSetup, xmallocRun},
+    {"cache-scratch", scratchSetup, scratchRun},
+};
+
+// Run a benchmark in this process (a fresh child) and fill in the result
+static int run(const benchmark* bench, const allocator* alloc, int threads, long ops, bench_result* result) {
+    if (alloc->malloc == sf_malloc) {
+        if (sf_set_heap_count(threads + 1 > SF_MAX_HEAPS ? SF_MAX_HEAPS : threads + 1) == -1) return -1;
+        if (tcacheCount > 0 && sf_mallopt(SF_OPT_TCACHE_COUNT, tcacheCount) == -1) return -1;
+        // The first thread to allocate is bound to heap 0, which sfutil limits to a few dozen kilobytes
+        sf_free(sf_malloc(1));
+    }
+    thread_args* args = calloc(threads, sizeof(thread_args));
+    pthread_t* ids = calloc(threads, sizeof(pthread_t));
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, threads);
+    for (int i = 0; i < threads; i++) {
+        args[i].index = i;
+        args[i].threads = threads;
+        args[i].ops = ops / threads;
+        args[i].alloc = alloc;
+        args[i].all = args;
+        args[i].barrier = &barrier;
+        args[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+    }
+    bench->setup(args, threads);
+
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&ids[i], NULL, bench->run, &args[i]) != 0) return -1;
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    result->opsPerSecond = (ops / threads) * (double)threads / (now() - start);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    result->maxRssKb = usage.ru_maxrss;
+    return 0;
+}
+
+// Run a benchmark in a child process, so that it starts w/ a fresh allocator
+static int runInChild(const benchmark* bench, const allocator* alloc, int threads, long ops, bench_result* result) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        bench_result child = {0, 0};
+        int status = run(bench, alloc, threads, ops, &child);
+        if (status == 0 && write(fds[1], &child, sizeof(child)) != sizeof(child)) status = -1;
+        _exit(status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(fds[1]);
+    ssize_t got = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (got != sizeof(*result) || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) return -1;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    long ops = 2000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+        if (opt == 'n') ops = atol(optarg);
+        else if (opt == 'c') tcacheCount = atoi(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-n operations] [-c tcache count] [benchmark...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (ops < 1) {
+        fprintf(stderr, "usage: %s [-n operations] [-c tcache count] [benchmark...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // 1, 2, 4, 8 and N threads, where N is the number of processors
+    int threadCounts[5] = {1, 2, 4, 8, 0};
+    int countCount = 4;
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors > SF_MAX_HEAPS - 1) processors = SF_MAX_HEAPS - 1;
+    if (processors != 1 && processors != 2 && processors != 4 && processors != 8) threadCounts[countCount++] = processors;
+
+    printf("%-14s %-10s %8s %12s %10s\n", "benchmark", "allocator", "threads", "Kops/s", "max RSS KB");
+    int failures = 0;
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        const benchmark* bench = &benchmarks[b];
+        if (optind < argc) {
+            int selected = 0;
+            for (int i = optind; i < argc; i++) {
+                if (strcmp(argv[i], bench->name) == 0) selected = 1;
+            }
+            if (!selected) continue;
+        }
+        for (int t = 0; t < countCount; t++) {
+            for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+                bench_result result;
+                if (runInChild(bench, &allocators[a], threadCounts[t], ops, &result) == -1) {
+                    printf("%-14s %-10s %8d failed\n", bench->name, allocators[a].name, threadCounts[t]);
+                    failures++;
+                    continue;
+                }
+                printf("%-14s %-10s %8d %12.1f %10ld\n", bench->name, allocators[a].name, threadCounts[t],
+                       result.opsPerSecond / 1e3, result.maxRssKb);
+            }
+        }
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,287 @@
+/*
+ * Replays allocation traces against the allocator, and reports throughput and memory utilization.
+ *
+ * Usage: sfmm_bench [-n repetitions] [-d count] [-m directory] trace...
+ *
+ * A trace is a text file w/ one operation per line. Lines starting w/ '#' are comments.
+ *     a <id> <size>    sf_malloc(size), and remember the pointer as id
+ *     r <id> <size>    sf_realloc the pointer remembered as id to size
+ *     f <id>           sf_free the pointer remembered as id
+ *
+ * Every trace is replayed in a child process of its own, so that it starts w/ an empty heap. The first replay checks that
+ * blocks are not corrupted and measures the peak heap size (sf_mem_end() - sf_mem_start()) and the peak live payload (the
+ * sum of the sizes requested for the blocks in use). Utilization is peak live payload / peak heap size. The following
+ * replays are timed, to measure throughput.
+ *
+ * -d turns on deferred coalescing, w/ up to count blocks in the quick lists (see SF_OPT_DEFER_COALESCING).
+ *
+ * With -m, the first replay also writes the heap map (see sf_heap_map_dump) at the peak live payload to directory/<trace>.map,
+ * for tools/heapmap.c to render.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sfmm_ext.h"
+
+typedef struct {
+    char type;
+    int id;
+    size_t size;
+} trace_op;
+
+typedef struct {
+    long ops;
+    double opsPerSecond;
+    size_t peakHeap;
+    size_t peakLive;
+    long failedOp;                                  // Index of the first operation that failed, or -1
+} trace_result;
+
+static trace_op* readTrace(const char* path, long* count, int* maxId) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+    long capacity = 1024;
+    trace_op* ops = malloc(capacity * sizeof(trace_op));
+    char line[128];
+    *count = 0;
+    *maxId = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        trace_op op = {0, 0, 0};
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (sscanf(line, "%c %d %zu", &op.type, &op.id, &op.size) < 2 || op.id < 0 ||
+            (op.type != 'a' && op.type != 'r' && op.type != 'f')) {
+            fprintf(stderr, "%s: bad line: %s", path, line);
+            free(ops);
+            fclose(file);
+            return NULL;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            ops = realloc(ops, capacity * sizeof(trace_op));
+        }
+        ops[(*count)++] = op;
+        if (op.id > *maxId) *maxId = op.id;
+    }
+    fclose(file);
+    return ops;
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// The first and last byte of every block hold a pattern derived from its id, which is checked when it is resized or freed
+static void writePattern(char* p, int id, size_t size) {
+    if (size == 0) return;
+    p[size - 1] = (char)(id * 7);
+    p[0] = (char)id;
+}
+
+static int patternIntact(char* p, int id, size_t size) {
+    if (size == 0) return 1;
+    return p[0] == (char)id && (size == 1 || p[size - 1] == (char)(id * 7));
+}
+
+// Return the index of the operation after which the live payload peaks
+static long findPeakOp(trace_op* ops, long count, size_t* sizes) {
+    size_t live = 0;
+    size_t peak = 0;
+    long peakOp = 0;
+    for (long i = 0; i < count; i++) {
+        live = live - sizes[ops[i].id] + ((ops[i].type == 'f') ? 0 : ops[i].size);
+        sizes[ops[i].id] = (ops[i].type == 'f') ? 0 : ops[i].size;
+        if (live > peak) {
+            peak = live;
+            peakOp = i;
+        }
+    }
+    return peakOp;
+}
+
+// Replay once, checking every block and measuring the peak heap size and live payload. If mapFd is not -1, write the heap map
+// to it after operation mapOp.
+// Returns -1 if all operations succeeded, or the index of the first one that failed.
+static long checkedReplay(trace_op* ops, long count, void** ptrs, size_t* sizes, int mapFd, long mapOp,
+                          trace_result* result) {
+    size_t live = 0;
+    for (long i = 0; i < count; i++) {
+        trace_op* op = &ops[i];
+        if (op->type != 'a' && !patternIntact(ptrs[op->id], op->id, sizes[op->id])) return i;
+
+        if (op->type == 'a') {
+            ptrs[op->id] = sf_malloc(op->size);
+            if (ptrs[op->id] == NULL && op->size != 0) return i;
+            live += op->size;
+        }
+        else if (op->type == 'r') {
+            void* p = sf_realloc(ptrs[op->id], op->size);
+            if (p == NULL && op->size != 0) return i;
+            if (op->size != 0 && sizes[op->id] != 0 && ((char*)p)[0] != (char)op->id) return i;
+            ptrs[op->id] = p;
+            live = live - sizes[op->id] + op->size;
+        }
+        else {
+            if (ptrs[op->id] != NULL) sf_free(ptrs[op->id]);
+            ptrs[op->id] = NULL;
+            live -= sizes[op->id];
+        }
+        sizes[op->id] = (op->type == 'f') ? 0 : op->size;
+        writePattern(ptrs[op->id], op->id, sizes[op->id]);
+
+        size_t heap = (char*)sf_mem_end() - (char*)sf_mem_start();
+        if (heap > result->peakHeap) result->peakHeap = heap;
+        if (live > result->peakLive) result->peakLive = live;
+        if (i == mapOp && mapFd != -1 && sf_heap_map_dump(mapFd, SF_HEAP_MAP_BINARY) == -1) return i;
+    }
+    return -1;
+}
+
+// Replay once as fast as possible
+static void timedReplay(trace_op* ops, long count, void** ptrs) {
+    for (long i = 0; i < count; i++) {
+        trace_op* op = &ops[i];
+        if (op->type == 'a') {
+            ptrs[op->id] = sf_malloc(op->size);
+        }
+        else if (op->type == 'r') {
+            ptrs[op->id] = sf_realloc(ptrs[op->id], op->size);
+        }
+        else {
+            if (ptrs[op->id] != NULL) sf_free(ptrs[op->id]);
+            ptrs[op->id] = NULL;
+        }
+    }
+}
+
+// Return the name of a trace: its file name w/o the directory
+static const char* getTraceName(const char* path) {
+    return strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+}
+
+// Replay a trace in this process (a fresh child) and fill in the result
+static int replay(const char* path, int repetitions, const char* mapDirectory, trace_result* result) {
+    long count;
+    int maxId;
+    trace_op* ops = readTrace(path, &count, &maxId);
+    if (ops == NULL) return -1;
+    int mapFd = -1;
+    if (mapDirectory != NULL) {
+        char mapPath[4096];
+        snprintf(mapPath, sizeof(mapPath), "%s/%.*s.map", mapDirectory, (int)strcspn(getTraceName(path), "."),
+                 getTraceName(path));
+        mapFd = open(mapPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (mapFd == -1) {
+            perror(mapPath);
+            free(ops);
+            return -1;
+        }
+    }
+    // sfutil logs every time the heap grows, which would only get in the way of the results
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1) {
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+    void** ptrs = calloc(maxId + 1, sizeof(void*));
+    size_t* sizes = calloc(maxId + 1, sizeof(size_t));
+
+    result->ops = count;
+    long mapOp = findPeakOp(ops, count, sizes);
+    memset(sizes, 0, (maxId + 1) * sizeof(size_t));
+    result->failedOp = checkedReplay(ops, count, ptrs, sizes, mapFd, mapOp, result);
+    if (mapFd != -1) close(mapFd);
+    if (result->failedOp == -1) {
+        double start = now();
+        for (int i = 0; i < repetitions; i++) {
+            timedReplay(ops, count, ptrs);
+        }
+        result->opsPerSecond = count * (double)repetitions / (now() - start);
+    }
+    free(ops);
+    free(ptrs);
+    free(sizes);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int repetitions = 20;
+    const char* mapDirectory = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:d:m:")) != -1) {
+        if (opt == 'n') repetitions = atoi(optarg);
+        else if (opt == 'd') {
+            if (sf_mallopt(SF_OPT_DEFER_COALESCING, atol(optarg)) == -1) repetitions = 0;
+        }
+        else if (opt == 'm') mapDirectory = optarg;
+        else {
+            fprintf(stderr, "usage: %s [-n repetitions] [-d count] [-m directory] trace...\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind == argc || repetitions < 1) {
+        fprintf(stderr, "usage: %s [-n repetitions] [-d count] [-m directory] trace...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-24s %8s %12s %10s %10s %7s\n", "trace", "ops", "Kops/s", "peak heap", "peak live", "util");
+    int traces = 0;
+    int failures = 0;
+    double totalUtilization = 0;
+    double totalOpsPerSecond = 0;
+    for (int i = optind; i < argc; i++) {
+        // Each trace gets a child process, and so a heap, of its own. The child sends its result back through a pipe.
+        int fds[2];
+        if (pipe(fds) == -1) {
+            perror("pipe");
+            return EXIT_FAILURE;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            trace_result result = {0, 0, 0, 0, -1};
+            int status = replay(argv[i], repetitions, mapDirectory, &result);
+            if (status == 0 && write(fds[1], &result, sizeof(result)) != sizeof(result)) status = -1;
+            _exit(status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        close(fds[1]);
+        trace_result result;
+        ssize_t got = read(fds[0], &result, sizeof(result));
+        close(fds[0]);
+        int status;
+        waitpid(pid, &status, 0);
+
+        const char* name = getTraceName(argv[i]);
+        if (got != sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            printf("%-24s crashed or could not be read\n", name);
+            failures++;
+            continue;
+        }
+        if (result.failedOp != -1) {
+            printf("%-24s failed at operation %ld\n", name, result.failedOp + 1);
+            failures++;
+            continue;
+        }
+        double utilization = result.peakHeap ? (double)result.peakLive / result.peakHeap : 0;
+        printf("%-24s %8ld %12.1f %10zu %10zu %6.1f%%\n", name, result.ops, result.opsPerSecond / 1e3,
+               result.peakHeap, result.peakLive, 100 * utilization);
+        traces++;
+        totalUtilization += utilization;
+        totalOpsPerSecond += result.opsPerSecond;
+    }
+    if (traces > 0) {
+        printf("%-24s %8s %12.1f %10s %10s %6.1f%%\n", "mean", "", totalOpsPerSecond / traces / 1e3, "", "",
+               100 * totalUtilization / traces);
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
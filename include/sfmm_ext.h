@@ -0,0 +1,496 @@
+/**
+ * Extensions to the allocator interface.
+ *
+ * sfmm.h must not be modified, so every prototype or constant that goes beyond the original
+ * assignment lives here instead.  Including this header also includes sfmm.h.
+ */
+#ifndef SFMM_EXT_H
+#define SFMM_EXT_H
+#include "sfmm.h"
+
+/*
+ * Unlike the layout described in sfmm.h, only free blocks have a footer.  An allocated block
+ * uses the row where its footer would be as payload, so a request of up to 24 bytes fits in a
+ * 32-byte block.  Instead, the header of every block (and the epilogue) records in bit 3 whether
+ * the block before it in memory is allocated, which is all that freeing needs to know about the
+ * previous block before deciding whether to read its footer and coalesce with it.
+ */
+#define PREV_BLOCK_ALLOCATED 0x08
+
+/*
+ * Bit 2 of the header is set in blocks that have a mapping of their own, outside of every heap
+ * (see SF_OPT_MMAP_THRESHOLD).
+ */
+#define MAPPED_BLOCK 0x04
+
+/*
+ * Bit 1 of the header is set in allocated blocks that the heap profiler has sampled (see
+ * SF_OPT_SAMPLE_RATE), so that freeing any other block does not need to look for a sample.
+ */
+#define SAMPLED_BLOCK 0x02
+
+/*
+ * The allocator can run as several independent heaps.  Each heap has its own free lists,
+ * its own wilderness block, its own region of memory and its own lock.  Every thread is bound
+ * to one heap (round-robin, on its first allocation) and allocates only from that heap.
+ * A block is always freed back into the heap that it was allocated from.
+ *
+ * Heap 0 is the heap managed by sfutil (sf_mem_start/sf_mem_end/sf_mem_grow) and uses
+ * sf_free_list_heads.  The other heaps live in regions of SF_HEAP_SPAN bytes reserved with mmap.
+ *
+ * Built with SF_STANDALONE defined (as the preload library is), the allocator does not use
+ * sfutil, which gets its memory from the system malloc and only grows to a few pages.  Heap 0 is
+ * then reserved with mmap like the other heaps, and every heap can grow to 1 GiB.
+ */
+#define SF_MAX_HEAPS 64
+#ifdef SF_STANDALONE
+#define SF_HEAP_SPAN ((size_t)1 << 30)
+#else
+#define SF_HEAP_SPAN ((size_t)64 << 20)
+#endif
+
+/*
+ * Sets the number of heaps that threads are spread over.  If this is never called, the
+ * number of heaps is taken from the SF_HEAPS environment variable, and defaults to 1.
+ *
+ * @param count The number of heaps, between 1 and SF_MAX_HEAPS.
+ *
+ * @return 0 on success.  If count is out of range, or if an allocation has already been made,
+ * then -1 is returned and sf_errno is set to EINVAL.
+ */
+int sf_set_heap_count(int count);
+
+/*
+ * sf_errno is a single process-wide variable (it is defined by sfutil), so it is not reliable
+ * when several threads use the allocator.  Every function that sets sf_errno also sets a
+ * thread-local copy, which can be read through sf_thread_errno.
+ *
+ * @return The address of the calling thread's copy of sf_errno.
+ */
+int *sf_errno_location(void);
+#define sf_thread_errno (*sf_errno_location())
+
+/*
+ * Options for sf_mallopt.
+ *
+ * SF_OPT_TCACHE_COUNT: The number of freed blocks that each thread keeps in its cache for every
+ * block size from 32 to 1024 bytes, between 0 and SF_TCACHE_MAX_COUNT.  Cached blocks are handed
+ * back by sf_malloc w/o taking a lock, and are not coalesced until the cache overflows and gives
+ * half of them back to the free lists.  Defaults to 0, which disables the cache.
+ *
+ * SF_OPT_GROW_CHUNK: The smallest number of bytes that a heap grows by when its wilderness block
+ * is too small, between PAGE_SZ and SF_HEAP_SPAN.  It is rounded up to a multiple of PAGE_SZ.
+ * Defaults to PAGE_SZ.
+ *
+ * SF_OPT_GROW_PERCENT: When a heap grows, it also grows by at least this percentage of its current
+ * size, between 0 and SF_GROW_MAX_PERCENT, so that a heap that keeps growing does so geometrically.
+ * Defaults to 0.
+ *
+ * Either way, a heap always grows by at least what the request is missing, all in one step.
+ *
+ * SF_OPT_MMAP_THRESHOLD: Requests of at least this many bytes get a mapping of their own instead
+ * of a block in a heap.  sf_free unmaps it at once, and sf_realloc resizes it with mremap, which
+ * never copies the payload.  sf_memalign maps a request once its size plus the alignment (less
+ * 32) reaches this many bytes, as that is the size of the heap block it would carve the aligned
+ * block from.  Defaults to 0, which disables mapped blocks.
+ *
+ * SF_OPT_TRIM_THRESHOLD: Once a free leaves the wilderness block of a heap larger than this many
+ * bytes, the heap is trimmed (see sf_trim), keeping SF_OPT_GROW_CHUNK bytes of the wilderness
+ * block.  Defaults to 0, which disables automatic trimming.
+ *
+ * SF_OPT_SAMPLE_RATE: Turns on the heap profiler (see sf_heap_profile_dump), which samples one
+ * allocation about every this many bytes allocated, and records the stack trace of the caller
+ * until the block is freed.  The gaps between samples are drawn at random from an exponential
+ * distribution, so that every byte allocated is equally likely to be sampled.  Defaults to 0,
+ * which disables the profiler.  SF_DEFAULT_SAMPLE_RATE is cheap enough to leave on.
+ *
+ * SF_OPT_DEFER_COALESCING: Turns on deferred coalescing.  A heap then keeps the blocks of up to
+ * 1024 bytes freed into it in quick lists, one per block size, without coalescing them, and an
+ * allocation of exactly that size takes one back without a search or a split.  The quick lists
+ * are coalesced into the free lists all at once when a heap holds more than this many blocks in
+ * them, when an allocation finds no free block that fits, and by sf_trim.  Until then, their
+ * blocks count as in use in sf_get_stats.  Defaults to 0, which coalesces every block as it is
+ * freed.
+ */
+#define SF_OPT_TCACHE_COUNT 1
+#define SF_TCACHE_MAX_COUNT 256
+#define SF_OPT_GROW_CHUNK 2
+#define SF_OPT_GROW_PERCENT 3
+#define SF_GROW_MAX_PERCENT 1000
+#define SF_OPT_MMAP_THRESHOLD 4
+#define SF_OPT_TRIM_THRESHOLD 5
+#define SF_OPT_SAMPLE_RATE 6
+#define SF_DEFAULT_SAMPLE_RATE (512 * 1024)
+#define SF_OPT_DEFER_COALESCING 7
+
+/*
+ * Sets an allocator option.
+ *
+ * @param option One of the SF_OPT_* constants.
+ * @param value The new value of the option.
+ *
+ * @return 0 on success.  If the option is unknown or the value is out of range, then -1 is
+ * returned and sf_errno is set to EINVAL.
+ */
+int sf_mallopt(int option, long value);
+
+/*
+ * Gives the memory at the end of every heap that is not in use back to the OS.  The wilderness
+ * block of each heap keeps its first keep bytes, and the whole pages after that are released.
+ * The heaps that live in mmap'ed regions also shrink, so they move their epilogue back.  The
+ * pages of heap 0 are only discarded, because sfutil cannot shrink it.
+ *
+ * @param keep The number of bytes of each wilderness block to keep.
+ *
+ * @return The number of bytes released.
+ */
+size_t sf_trim(size_t keep);
+
+/*
+ * Allocates zeroed memory for an array.  Memory that has not been written to since a heap grew
+ * over it (or since it was mapped) is known to be zero, and is not zeroed again.
+ *
+ * @param nmemb The number of elements.
+ * @param size The size of each element.
+ *
+ * @return If nmemb * size is 0, then NULL is returned without setting sf_errno.  If the
+ * allocation is successful, a pointer to nmemb * size bytes of zeroed memory is returned.
+ * If nmemb * size overflows or the allocation is not successful, then NULL is returned and
+ * sf_errno is set to ENOMEM.
+ */
+void *sf_calloc(size_t nmemb, size_t size);
+
+/*
+ * Allocates at least size bytes, and reports how many bytes were actually made available.  Blocks
+ * are rounded up to a multiple of 32 bytes, and are not split when that would leave a splinter,
+ * so there is often room beyond size that the caller may use.
+ *
+ * @param size The number of bytes requested to be allocated.
+ * @param actual Where to store the usable size of the block, if the allocation is successful.
+ *
+ * @return The same as sf_malloc.
+ */
+void *sf_malloc_at_least(size_t size, size_t *actual);
+
+/*
+ * Returns the number of bytes that can be used at the given address, which is at least the size
+ * that was requested for it.
+ *
+ * @param ptr Address of memory returned by sf_malloc, etc.
+ *
+ * @return The usable size of the block.  If ptr is NULL, then 0 is returned.  If ptr is invalid,
+ * then 0 is returned and sf_errno is set to EINVAL.
+ */
+size_t sf_malloc_usable_size(void *ptr);
+
+/*
+ * Frees a block whose size the caller knows, like a sized operator delete.  In release builds
+ * the pointer is trusted and is not validated, which makes this faster than sf_free.  Builds
+ * w/ DEBUG defined check the pointer as sf_free does, and also that size is a size that could
+ * have been requested for the block.
+ *
+ * @param ptr Address of memory returned by sf_malloc, etc.
+ * @param size The size that was requested for the block.
+ *
+ * In debug builds, if ptr is invalid or size does not match the block, the function calls
+ * abort() to exit the program.
+ */
+void sf_free_sized(void *ptr, size_t size);
+
+/*
+ * Allocates count blocks of the same size at once.  The blocks are cut from a single free block
+ * (or the wilderness block) whenever the heap has one large enough, so they are usually adjacent.
+ * Blocks of at least SF_OPT_MMAP_THRESHOLD bytes get a mapping each instead, as with sf_malloc.
+ *
+ * @param size The number of bytes requested for each block.
+ * @param count The number of blocks requested.
+ * @param out Where to store the addresses of the allocated blocks.
+ *
+ * @return The number of blocks allocated, whose addresses are stored in out[0] onwards.  If
+ * size or count is 0, then 0 is returned without setting sf_errno.  If fewer than count blocks
+ * could be allocated, then sf_errno is set to ENOMEM.
+ */
+size_t sf_malloc_batch(size_t size, size_t count, void **out);
+
+/*
+ * Frees count blocks at once.  The pointers are sorted by address (in place), and every run of
+ * blocks that are adjacent in memory is coalesced and put in a free list once.
+ *
+ * @param ptrs Addresses of memory returned by sf_malloc, sf_malloc_batch, etc.
+ * @param count The number of pointers in ptrs.
+ *
+ * If any pointer is invalid, or appears twice, the function calls abort() to exit the program
+ * before anything is freed.
+ */
+void sf_free_batch(void **ptrs, size_t count);
+
+/*
+ * posix_memalign, on top of sf_memalign.  Alignments below 32 are rounded up to 32.  The parts
+ * of the block that sf_memalign carves the aligned block from are freed, not kept as padding.
+ *
+ * @param memptr Where to store the address of the allocated memory.
+ * @param align The alignment required of the returned pointer.
+ * @param size The number of bytes requested to be allocated.
+ *
+ * @return 0 on success.  If align is not a power of two multiple of sizeof(void *), then EINVAL
+ * is returned.  If the allocation is not successful, then ENOMEM is returned.  *memptr is
+ * only modified on success, and is set to NULL if size is 0.
+ */
+int sf_posix_memalign(void **memptr, size_t align, size_t size);
+
+/*
+ * aligned_alloc, on top of sf_memalign.  Alignments below 32 are rounded up to 32.
+ *
+ * @param align The alignment required of the returned pointer.
+ * @param size The number of bytes requested to be allocated.
+ *
+ * @return The same as sf_memalign, except that align may be any power of two.
+ */
+void *sf_aligned_alloc(size_t align, size_t size);
+
+/*
+ * Allocator statistics, filled in by sf_get_stats.  Sizes are in bytes and include block headers.
+ *
+ * in_use: Bytes of the blocks that are allocated, in every heap and in mappings of their own.
+ * Blocks held in thread caches (see SF_OPT_TCACHE_COUNT), and blocks freed by other threads
+ * that their heap has not taken back yet, count as allocated.
+ *
+ * peak_in_use: The sum, over every heap (and mapped blocks), of the largest in_use it has had.
+ * This is the exact peak w/ a single heap and no mapped blocks, and an upper bound otherwise.
+ *
+ * heap_size: The sum of the sizes of every heap (sf_mem_end() - sf_mem_start() for heap 0),
+ * plus the size of every mapping of a mapped block.  mapped_blocks: The number of those mappings.
+ *
+ * free_blocks, free_bytes: The number and total size of the free blocks in each free list,
+ * over every heap.  Index i is the list at sf_free_list_heads[i].
+ *
+ * mallocs, frees, reallocs: The number of blocks allocated (by sf_malloc, sf_calloc,
+ * sf_memalign, sf_malloc_batch, etc.), of blocks freed (by sf_free, sf_free_sized and
+ * sf_free_batch), and of calls to sf_realloc.  A sf_realloc that moves the block only counts
+ * as a realloc, and a failed allocation does not count.
+ *
+ * growths: The number of times a heap grew.  splits, coalesces: The number of times a block was
+ * split in two, and two free blocks were coalesced into one.
+ *
+ * largest_free_block, fragmentation: The largest free block of any heap, and an estimate of
+ * external fragmentation: 1 - largest_free_block / the total size of the free blocks, which is
+ * 0 when the free memory is all in one block and approaches 1 as it is scattered in small ones.
+ */
+struct sf_stats {
+    size_t in_use;
+    size_t peak_in_use;
+    size_t heap_size;
+    size_t mapped_blocks;
+    size_t free_blocks[NUM_FREE_LISTS];
+    size_t free_bytes[NUM_FREE_LISTS];
+    size_t mallocs;
+    size_t frees;
+    size_t reallocs;
+    size_t growths;
+    size_t splits;
+    size_t coalesces;
+    size_t largest_free_block;
+    double fragmentation;
+};
+
+/*
+ * Reads the allocator statistics.  The counters are kept by every allocation and free at little
+ * cost, so they are always on.  The free lists of each heap are read under its lock, but the
+ * heaps are read one after the other, so the statistics are not a snapshot of a single instant
+ * while other threads allocate.
+ *
+ * @param stats Where to store the statistics.
+ */
+void sf_get_stats(struct sf_stats *stats);
+
+/*
+ * Writes the allocations sampled by the heap profiler (see SF_OPT_SAMPLE_RATE) that are still
+ * live, in the legacy text format of pprof heap profiles ("heap_v2"), followed by the memory
+ * map of the process so that pprof can symbolize the stack traces.  pprof scales the sampled
+ * sizes back up to estimates of the real ones.  As only live allocations are tracked, the
+ * allocated totals of the profile are the same as the in-use ones.
+ *
+ *     pprof --text <program> <profile>
+ *
+ * @param fd The file descriptor to write the profile to.
+ *
+ * @return 0 on success, or -1 if writing to fd failed.
+ */
+int sf_heap_profile_dump(int fd);
+
+/*
+ * Heap maps, written by sf_heap_map_dump.  In the binary format, a sf_heap_map_header is
+ * followed, for each heap, by a sf_heap_map_heap and then by one sf_heap_map_block for each of
+ * its blocks, in address order.  Every field is in the byte order of the machine that wrote it.
+ * tools/heapmap.c renders a binary heap map as a fragmentation map and free-size histograms.
+ *
+ * The JSON format holds the same records, one block per line, as [offset, size, allocated, list]:
+ *
+ *     {"version": 1, "heaps": [
+ *     {"heap": 0, "size": 2048, "blocks": [
+ *     [56, 64, 1, -1],
+ *     [120, 1920, 0, 7]]}]}
+ *
+ * offset: The offset of the block (its header) from the start of its heap.  list: The index of
+ * the free list holding a free block (NUM_FREE_LISTS-1 for the wilderness block), or -1 for an
+ * allocated block.  Blocks held in a thread cache or in a quick list (see
+ * SF_OPT_DEFER_COALESCING), or waiting to be freed by their heap, are still allocated as far as
+ * the heap is concerned.  The padding, prologue and epilogue are left out, and so are mapped
+ * blocks, which are not in any heap.
+ */
+#define SF_HEAP_MAP_BINARY 0
+#define SF_HEAP_MAP_JSON 1
+#define SF_HEAP_MAP_MAGIC 0x50414d48    /* "HMAP" */
+#define SF_HEAP_MAP_VERSION 1
+
+struct sf_heap_map_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t heaps;
+};
+
+struct sf_heap_map_heap {
+    uint64_t size;                      /* sf_mem_end() - sf_mem_start() for heap 0 */
+    uint64_t blocks;
+};
+
+struct sf_heap_map_block {
+    uint64_t offset;
+    uint32_t size;
+    uint8_t allocated;
+    int8_t list;
+    uint16_t reserved;
+};
+
+/*
+ * Writes a map of every heap: the offset, size, allocated bit and free list of each of its
+ * blocks, found by walking the heap from the prologue to the epilogue by the sizes in the block
+ * headers.  Each heap is walked under its lock, so a heap's map is a snapshot, but other threads
+ * that allocate from that heap wait until its map is written out.
+ *
+ * @param fd The file descriptor to write the map to.
+ * @param format SF_HEAP_MAP_BINARY or SF_HEAP_MAP_JSON.
+ *
+ * @return 0 on success.  -1 if writing to fd failed, or if format is not valid, in which case
+ * sf_errno is set to EINVAL.
+ */
+int sf_heap_map_dump(int fd, int format);
+
+/*
+ * Arenas (regions), for objects that all die together.  An arena hands out memory by bumping a
+ * pointer through chunks that it gets from sf_malloc, and never frees an object by itself:
+ * sf_arena_reset frees everything at once in constant time, and keeps the chunks so that the
+ * arena reuses them, in the same order, before it asks sf_malloc for more.  An arena that
+ * allocates the same way after every reset thus stops calling sf_malloc at all.  The chunks only
+ * go back to the heap w/ sf_arena_destroy.
+ *
+ * New chunks start at the initial size given to sf_arena_create (or 1 KiB) and double in size
+ * up to 256 KiB, and a request that does not fit in one gets a chunk of its own size.  An arena
+ * is not thread-safe: each thread should have its own, or lock around it.
+ */
+#define SF_ARENA_ALIGN 16               /* Alignment of sf_arena_alloc(arena, size, 0) */
+
+struct sf_arena;
+
+/*
+ * Creates an empty arena.
+ *
+ * @param initial The size of the arena's first chunk, which is allocated right away unless
+ * initial is 0.
+ *
+ * @return The arena, or NULL if there is no memory for it, in which case sf_errno is set to
+ * ENOMEM.
+ */
+struct sf_arena *sf_arena_create(size_t initial);
+
+/*
+ * Allocates memory from an arena.  Memory allocated from an arena must not be given to sf_free
+ * or sf_realloc.
+ *
+ * @param arena The arena.
+ * @param size The number of bytes requested.
+ * @param align The alignment of the memory, a power of two, or 0 for SF_ARENA_ALIGN.
+ *
+ * @return If size is 0, then NULL is returned without setting sf_errno.  If align is not 0 or
+ * a power of two, NULL is returned and sf_errno is set to EINVAL.  If the arena needs a new
+ * chunk and there is no memory for it, NULL is returned and sf_errno is set to ENOMEM.
+ */
+void *sf_arena_alloc(struct sf_arena *arena, size_t size, size_t align);
+
+/*
+ * Frees everything allocated from an arena, in constant time.  The arena keeps its chunks.
+ *
+ * @param arena The arena.
+ */
+void sf_arena_reset(struct sf_arena *arena);
+
+/*
+ * Frees an arena and gives all of its chunks back to the heap.  Does nothing if arena is NULL.
+ *
+ * @param arena The arena.
+ */
+void sf_arena_destroy(struct sf_arena *arena);
+
+/*
+ * Object pools, for many objects of one size.  A pool carves its objects out of slabs of at
+ * least 4 KiB that it gets from sf_malloc, back to back w/o any header or footer, so that the
+ * only overhead is the padding of the object size to the alignment, against the 8 to 39 bytes
+ * of a block (16 of 64 for a 48-byte object).  Freed objects go on a free list threaded through
+ * the objects themselves, which the pool allocates from first.  The slabs only go back to the
+ * heap w/ sf_pool_destroy.  A pool is not thread-safe: each thread should have its own, or lock
+ * around it.
+ */
+struct sf_pool;
+
+/*
+ * Creates a pool of objects of one size, w/o allocating any slab yet.
+ *
+ * @param obj_size The size of every object, at least 1.
+ * @param align The alignment of the objects, a power of two, or 0 for 16 if obj_size is a
+ * multiple of 16 and 8 otherwise, which is enough for any C type of that size.  Objects are at
+ * least 8 bytes long and 8-aligned, as a free object holds a pointer.
+ *
+ * @return The pool.  If obj_size is 0 or align is not valid, NULL is returned and sf_errno is
+ * set to EINVAL.  If there is no memory for the pool, NULL is returned and sf_errno is set to
+ * ENOMEM.
+ */
+struct sf_pool *sf_pool_create(size_t obj_size, size_t align);
+
+/*
+ * Allocates an object from a pool.
+ *
+ * @param pool The pool.
+ *
+ * @return The object, or NULL if the pool needs a new slab and there is no memory for it, in
+ * which case sf_errno is set to ENOMEM.
+ */
+void *sf_pool_alloc(struct sf_pool *pool);
+
+/*
+ * Gives an object back to the pool it was allocated from.  Does nothing if ptr is NULL.  As
+ * objects have no header, nothing checks that ptr belongs to the pool or is not already free.
+ *
+ * @param pool The pool.
+ * @param ptr An object allocated by sf_pool_alloc(pool).
+ */
+void sf_pool_free(struct sf_pool *pool, void *ptr);
+
+/*
+ * Frees a pool and gives all of its slabs back to the heap, whether their objects were freed or
+ * not.  Does nothing if pool is NULL.
+ *
+ * @param pool The pool.
+ */
+void sf_pool_destroy(struct sf_pool *pool);
+
+/*
+ * Fork handlers.  A process that forks while other threads may be allocating must register
+ * them with pthread_atfork(sf_fork_prepare, sf_fork_parent, sf_fork_child), or the child could
+ * inherit a lock held by a thread that does not exist in it.  sf_fork_prepare takes every lock
+ * of the allocator, and the other two release them.  The preload library registers them.
+ */
+void sf_fork_prepare(void);
+void sf_fork_parent(void);
+void sf_fork_child(void);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * Preload library: makes the allocator the malloc of a dynamically linked program, w/o relinking it.
+ *
+ *     make preload
+ *     LD_PRELOAD=bin/libsfmm.so program
+ *
+ * Exports the allocation functions that glibc lets a program replace (malloc, free, calloc, realloc, reallocarray,
+ * posix_memalign, aligned_alloc, memalign, valloc, pvalloc and malloc_usable_size), and the C++ operators new and delete
+ * under their mangled names, on top of sf_malloc, sf_free, sf_realloc and sf_memalign. Unlike the sf_ functions, they follow
+ * glibc where it matters to programs: a request for 0 bytes returns a block, free(NULL) does nothing, and failures set errno.
+ *
+ * The allocator is built w/ SF_STANDALONE, so it takes all of its memory from mmap (see sfmm_ext.h), and w/ the initial-exec
+ * TLS model, which is why the library must be preloaded rather than dlopen'ed.
+ *
+ * Bootstrap: nothing is forwarded to glibc's malloc, so there is no dlsym(RTLD_NEXT, "malloc") to resolve, and the allocator
+ * sets itself up on its first call, whenever it comes (from the dynamic loader, from libc, or from a constructor that runs
+ * before the one below). Setting up only uses getenv, mmap and pthread_once, none of which allocate. The constructor only
+ * changes options, which can change at any time.
+ *
+ * Fork: the constructor registers the allocator's fork handlers (see sf_fork_prepare), so that a child forked while other
+ * threads allocate does not inherit their locks.
+ *
+ * Environment: SF_HEAPS sets the number of heaps (see sf_set_heap_count). SF_TCACHE_COUNT, SF_MMAP_THRESHOLD,
+ * SF_TRIM_THRESHOLD and SF_SAMPLE_RATE set the sf_mallopt option of the same name. The defaults follow glibc's: a thread
+ * cache of 7 blocks per size, and blocks of 128 KiB or more in mappings of their own.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "sfmm_ext.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define DEFAULT_TCACHE_COUNT 7
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+#define DEFAULT_TRIM_THRESHOLD (128 * 1024)
+
+// Set an option from the environment variable of the given name, or to the given default if it is not set
+static void setOption(int option, const char* name, long defaultValue) {
+    char* value = getenv(name);
+    sf_mallopt(option, (value != NULL) ? atol(value) : defaultValue);
+}
+
+__attribute__((constructor)) static void initPreload(void) {
+    setOption(SF_OPT_TCACHE_COUNT, "SF_TCACHE_COUNT", DEFAULT_TCACHE_COUNT);
+    setOption(SF_OPT_MMAP_THRESHOLD, "SF_MMAP_THRESHOLD", DEFAULT_MMAP_THRESHOLD);
+    setOption(SF_OPT_TRIM_THRESHOLD, "SF_TRIM_THRESHOLD", DEFAULT_TRIM_THRESHOLD);
+    setOption(SF_OPT_SAMPLE_RATE, "SF_SAMPLE_RATE", 0);
+    pthread_atfork(sf_fork_prepare, sf_fork_parent, sf_fork_child);
+}
+
+// C allocation functions ----------------------------------------------------------------------------------------------
+
+// Allocate size bytes aligned to align (a power of two), setting errno on failure
+static void* allocate(size_t size, size_t align) {
+    if (size == 0) size = 1;
+    void* pp = (align <= 32) ? sf_malloc(size) : sf_memalign(size, align);
+    if (pp == NULL) errno = ENOMEM;
+    return pp;
+}
+
+// Round an alignment up to a power of two of at least 32, as glibc's memalign does w/ any alignment
+static size_t roundAlignment(size_t align) {
+    size_t rounded = 32;
+    while (rounded < align && rounded != 0) rounded <<= 1;
+    return rounded;
+}
+
+EXPORT void* malloc(size_t size) {
+    return allocate(size, 32);
+}
+
+EXPORT void free(void* pp) {
+    if (pp != NULL) sf_free(pp);
+}
+
+EXPORT void* calloc(size_t nmemb, size_t size) {
+    if (nmemb != 0 && size > SIZE_MAX / nmemb) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void* pp = sf_calloc(1, (nmemb * size == 0) ? 1 : nmemb * size);
+    if (pp == NULL) errno = ENOMEM;
+    return pp;
+}
+
+EXPORT void* realloc(void* pp, size_t size) {
+    if (pp == NULL) return allocate(size, 32);
+    if (size == 0) {
+        sf_free(pp);
+        return NULL;
+    }
+    void* resized = sf_realloc(pp, size);
+    if (resized == NULL) {
+        // Like glibc, stop at a pointer that was never allocated rather than return an error the caller will not expect
+        if (sf_thread_errno == EINVAL) abort();
+        errno = ENOMEM;
+    }
+    return resized;
+}
+
+EXPORT void* reallocarray(void* pp, size_t nmemb, size_t size) {
+    if (nmemb != 0 && size > SIZE_MAX / nmemb) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(pp, nmemb * size);
+}
+
+EXPORT int posix_memalign(void** memptr, size_t align, size_t size) {
+    if (align < sizeof(void*) || (align & (align - 1)) != 0) return EINVAL;
+    void* pp = allocate(size, align);
+    if (pp == NULL) return ENOMEM;
+    *memptr = pp;
+    return 0;
+}
+
+EXPORT void* aligned_alloc(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return allocate(size, align);
+}
+
+EXPORT void* memalign(size_t align, size_t size) {
+    size_t rounded = roundAlignment(align);
+    if (rounded == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return allocate(size, rounded);
+}
+
+EXPORT void* valloc(size_t size) {
+    return allocate(size, sysconf(_SC_PAGESIZE));
+}
+
+EXPORT void* pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return allocate((size + page - 1) & ~(page - 1), page);
+}
+
+EXPORT size_t malloc_usable_size(void* pp) {
+    return sf_malloc_usable_size(pp);
+}
+
+// C++ operators ----------------------------------------------------------------------------------------------------------
+// When no memory is left, operator new calls the new handler installed by the program, which may free some memory or throw,
+//      and throws std::bad_alloc if there is none. C cannot throw, so this goes through libstdc++'s own std::get_new_handler
+//      and std::__throw_bad_alloc, which every C++ program links to, and this file is built w/ -fexceptions, so that the
+//      exceptions can unwind through it. The nothrow forms return NULL instead of throwing.
+typedef void (*new_handler)(void);
+extern new_handler _ZSt15get_new_handlerv(void) __attribute__((weak));
+extern void _ZSt17__throw_bad_allocv(void) __attribute__((weak, noreturn));
+
+static void* newObject(size_t size, size_t align, int nothrow) {
+    for (;;) {
+        void* pp = allocate(size, align);
+        if (pp != NULL) return pp;
+        new_handler handler = (_ZSt15get_new_handlerv != NULL) ? _ZSt15get_new_handlerv() : NULL;
+        if (handler == NULL) {
+            if (nothrow) return NULL;
+            if (_ZSt17__throw_bad_allocv != NULL) _ZSt17__throw_bad_allocv();
+            abort();
+        }
+        handler();
+    }
+}
+
+// A sized delete of a block that was not aligned by sf_memalign gives its size to sf_free_sized, which skips the checks
+static void deleteObject(void* pp, size_t size, size_t align) {
+    if (pp == NULL) return;
+    if (align <= 32 && size != 0) sf_free_sized(pp, size);
+    else sf_free(pp);
+}
+
+EXPORT void* _Znwm(size_t size) { return newObject(size, 32, 0); }
+EXPORT void* _Znam(size_t size) { return newObject(size, 32, 0); }
+EXPORT void* _ZnwmRKSt9nothrow_t(size_t size, const void* tag) { return newObject(size, 32, 1); }
+EXPORT void* _ZnamRKSt9nothrow_t(size_t size, const void* tag) { return newObject(size, 32, 1); }
+EXPORT void* _ZnwmSt11align_val_t(size_t size, size_t align) { return newObject(size, align, 0); }
+EXPORT void* _ZnamSt11align_val_t(size_t size, size_t align) { return newObject(size, align, 0); }
+EXPORT void* _ZnwmSt11align_val_tRKSt9nothrow_t(size_t size, size_t align, const void* tag) { return newObject(size, align, 1); }
+EXPORT void* _ZnamSt11align_val_tRKSt9nothrow_t(size_t size, size_t align, const void* tag) { return newObject(size, align, 1); }
+
+EXPORT void _ZdlPv(void* pp) { deleteObject(pp, 0, 32); }
+EXPORT void _ZdaPv(void* pp) { deleteObject(pp, 0, 32); }
+EXPORT void _ZdlPvm(void* pp, size_t size) { deleteObject(pp, size, 32); }
+EXPORT void _ZdaPvm(void* pp, size_t size) { deleteObject(pp, size, 32); }
+EXPORT void _ZdlPvRKSt9nothrow_t(void* pp, const void* tag) { deleteObject(pp, 0, 32); }
+EXPORT void _ZdaPvRKSt9nothrow_t(void* pp, const void* tag) { deleteObject(pp, 0, 32); }
+EXPORT void _ZdlPvSt11align_val_t(void* pp, size_t align) { deleteObject(pp, 0, align); }
+EXPORT void _ZdaPvSt11align_val_t(void* pp, size_t align) { deleteObject(pp, 0, align); }
+EXPORT void _ZdlPvmSt11align_val_t(void* pp, size_t size, size_t align) { deleteObject(pp, size, align); }
+EXPORT void _ZdaPvmSt11align_val_t(void* pp, size_t size, size_t align) { deleteObject(pp, size, align); }
+EXPORT void _ZdlPvSt11align_val_tRKSt9nothrow_t(void* pp, size_t align, const void* tag) { deleteObject(pp, 0, align); }
+EXPORT void _ZdaPvSt11align_val_tRKSt9nothrow_t(void* pp, size_t align, const void* tag) { deleteObject(pp, 0, align); }
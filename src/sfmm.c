@@ -2,22 +2,264 @@
  * Do not submit your assignment with a main function in this file.
  * If you submit with a main function in this file, you will get a zero.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "debug.h"
 #include "sfmm.h"
+#include "sfmm_ext.h"
 #include <stddef.h>
+#include <stdint.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <execinfo.h>
+
+
+
+// Heaps -------------------------------------------------------------------------------------------------------------------
+// Within the free lists 0..NUM_FREE_LISTS-3, blocks are grouped into the segments of a two-level segregated-fit index, one
+//      segment per block size (see getSegment). The blocks of list NUM_FREE_LISTS-2 (larger than SEGMENTED_MAX_SIZE) are
+//      also the nodes of a treap ordered by size and address, which finds the best fit for a large request.
+#define SEGMENTED_MAX_SIZE (13 * 32)
+#define SEGMENT_SL_LOG2 3
+#define SEGMENT_SL_COUNT (1 << SEGMENT_SL_LOG2)
+#define SEGMENT_FL_SHIFT 8                          // Every size below 1 << SEGMENT_FL_SHIFT is in first-level row 0
+#define SEGMENT_FL_COUNT 2                          // Enough rows for every size up to SEGMENTED_MAX_SIZE
+#define QUICK_MAX_BLOCK_SIZE 1024                   // Largest block kept in a quick list (see Deferred coalescing)
+#define QUICK_LISTS (QUICK_MAX_BLOCK_SIZE / 32)
+
+// A heap is one independent instance of the allocator: a set of free lists (including the wilderness list), a contiguous
+//      region of memory that starts with a prologue and ends with an epilogue, and a lock that protects both.
+typedef struct sf_heap {
+    pthread_mutex_t lock;
+    sf_block* freeListHeads;                        // NUM_FREE_LISTS sentinels (sf_free_list_heads for heap 0)
+    void* start;                                    // Start of the region
+    void* end;                                      // Current end of the region
+    void* limit;                                    // End of the reserved region (unused for heap 0 w/ sfutil, sf_mem_grow decides)
+    void* cleanFrom;                                // Every byte from here to end is zero, but the last two words (see markDirty)
+    sf_block* remoteFrees;                          // Lock-free stack of blocks freed by threads bound to other heaps
+    uint64_t flBitmap;                              // Bit fl is set if any segment in row fl is non-empty
+    uint8_t slBitmap[SEGMENT_FL_COUNT];             // Bit sl of slBitmap[fl] is set if segment (fl, sl) is non-empty
+    sf_block* segmentHeads[SEGMENT_FL_COUNT][SEGMENT_SL_COUNT];
+    sf_block* treeRoot;                             // Treap of the blocks in list NUM_FREE_LISTS-2
+    sf_block* quickLists[QUICK_LISTS];              // Quick list i holds freed, uncoalesced blocks of size 32 * (i+1)
+    size_t quickCount;                              // Blocks in the quick lists
+    size_t freeBlocks[NUM_FREE_LISTS];              // Number of blocks in each free list (see sf_get_stats)
+    size_t freeBytes[NUM_FREE_LISTS];               // Total size of the blocks in each free list
+    size_t freeBytesTotal;                          // Total size of the blocks in every free list
+    size_t peakInUse;                               // The most that getHeapInUse has returned
+    size_t growths;
+    size_t splits;
+    size_t coalesces;
+    sf_block ownFreeListHeads[NUM_FREE_LISTS];      // Storage for the sentinels of heaps other than heap 0
+} sf_heap;
+
+static sf_heap heaps[SF_MAX_HEAPS];
+static int heapCount = 0;                           // 0 until the heaps are set up
+static int requestedHeapCount = 0;                  // Set by sf_set_heap_count
+static void* secondaryHeapsBase = NULL;             // Start of the mmap'ed reservation for heaps 1..heapCount-1 (see heapOf)
+static pthread_once_t heapsOnce = PTHREAD_ONCE_INIT;
+static unsigned int nextHeap = 0;                   // Round-robin counter used to bind threads to heaps
+static size_t growChunk = PAGE_SZ;                  // Smallest amount a heap grows by. Set by sf_mallopt
+static int growPercent = 0;                         // Heaps also grow by at least this percentage of their size. Set by sf_mallopt
+static size_t trimThreshold = 0;                    // Trim a heap once its wilderness block is larger. Set by sf_mallopt
+
+static __thread sf_heap* threadHeap = NULL;         // Heap the calling thread is bound to
+static __thread int threadErrno = 0;                // Thread-local copy of sf_errno
+
+int *sf_errno_location(void){
+    return &threadErrno;
+}
+
+// Set both the process-wide sf_errno (for single-threaded callers) and the calling thread's copy
+void setErrno(int error){
+    threadErrno = error;
+    sf_errno = error;
+}
+
+// Set up the heap structures. Runs once, on the first allocation.
+void initHeaps(){
+    int count = requestedHeapCount;
+    if (count == 0){
+        char* env = getenv("SF_HEAPS");
+        count = (env != NULL) ? atoi(env) : 1;
+    }
+    if (count < 1) count = 1;
+    if (count > SF_MAX_HEAPS) count = SF_MAX_HEAPS;
+
+    // Reserve address space for every heap other than heap 0 up front. Pages are only backed by memory when touched.
+    //      W/o sfutil (SF_STANDALONE), heap 0 gets the first span of the reservation, and the other heaps follow it.
+#ifdef SF_STANDALONE
+    int reservedHeaps = count;
+#else
+    int reservedHeaps = count - 1;
+#endif
+    void* reservation = NULL;
+    if (reservedHeaps > 0){
+        reservation = mmap(NULL, reservedHeaps * SF_HEAP_SPAN, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reservation == MAP_FAILED){
+            reservation = NULL;
+            count = 1;
+        }
+    }
+    if (count > 1) secondaryHeapsBase = reservation + (reservedHeaps - (count-1)) * SF_HEAP_SPAN;
+
+    for (int i=0; i<count; i++){
+        sf_heap* heap = &heaps[i];
+        pthread_mutex_init(&heap->lock, NULL);
+        if (i == 0){
+            heap->freeListHeads = sf_free_list_heads;
+#ifdef SF_STANDALONE
+            // If nothing could be reserved, the heap has no room to grow, and every allocation fails w/ ENOMEM
+            heap->start = reservation;
+            heap->end = reservation;
+            heap->limit = (reservation != NULL) ? reservation + SF_HEAP_SPAN : NULL;
+            heap->cleanFrom = reservation;
+#else
+            heap->start = NULL;
+            heap->end = NULL;
+            heap->limit = NULL;
+            heap->cleanFrom = (void*)UINTPTR_MAX;   // sfutil does not promise that its pages are zero
+#endif
+        }
+        else{
+            heap->freeListHeads = heap->ownFreeListHeads;
+            heap->start = secondaryHeapsBase + (i-1) * SF_HEAP_SPAN;
+            heap->end = heap->start;
+            heap->limit = heap->start + SF_HEAP_SPAN;
+            heap->cleanFrom = heap->start;          // Fresh anonymous mappings are zero
+        }
+    }
+    __atomic_store_n(&heapCount, count, __ATOMIC_RELEASE);
+}
+
+int sf_set_heap_count(int count){
+    if (count < 1 || count > SF_MAX_HEAPS || __atomic_load_n(&heapCount, __ATOMIC_ACQUIRE) != 0){
+        setErrno(EINVAL);
+        return -1;
+    }
+    requestedHeapCount = count;
+    return 0;
+}
+
+// Return the heap the calling thread allocates from, binding the thread to a heap on its first call.
+sf_heap* getThreadHeap(){
+    if (threadHeap == NULL){
+        pthread_once(&heapsOnce, initHeaps);
+        unsigned int i = __atomic_fetch_add(&nextHeap, 1, __ATOMIC_RELAXED) % heapCount;
+        threadHeap = &heaps[i];
+    }
+    return threadHeap;
+}
+
+// Return the heap whose region contains the given address, or NULL if it is not in any heap.
+sf_heap* heapOf(void* p){
+    int count = __atomic_load_n(&heapCount, __ATOMIC_ACQUIRE);
+    if (count == 0) return NULL;
+    if (secondaryHeapsBase != NULL && p >= secondaryHeapsBase && p < secondaryHeapsBase + (count-1) * SF_HEAP_SPAN){
+        sf_heap* heap = &heaps[1 + (p - secondaryHeapsBase) / SF_HEAP_SPAN];
+        if (p < __atomic_load_n(&heap->end, __ATOMIC_ACQUIRE)) return heap;
+        return NULL;
+    }
+    if (p >= heaps[0].start && p < __atomic_load_n(&heaps[0].end, __ATOMIC_ACQUIRE)) return &heaps[0];
+    return NULL;
+}
+
+// Add up to size bytes (a multiple of PAGE_SZ) to the end of the region of a heap, as many as it can. Returns the start of the
+//      new region and sets *grown to its size, or returns NULL if the heap cannot grow at all.
+void* heapGrow(sf_heap* heap, size_t size, size_t* grown){
+    void* region;
+#ifndef SF_STANDALONE
+    if (heap == &heaps[0]){
+        // sf_mem_grow only adds one page at a time, but the pages are contiguous
+        region = sf_mem_grow();
+        if (region == NULL) return NULL;
+        *grown = PAGE_SZ;
+        while (*grown < size && sf_mem_grow() != NULL){
+            *grown += PAGE_SZ;
+        }
+        heap->start = sf_mem_start();
+        __atomic_store_n(&heap->end, sf_mem_end(), __ATOMIC_RELEASE);
+        heap->growths++;
+        return region;
+    }
+#endif
+    size_t available = heap->limit - heap->end;
+    if (available < PAGE_SZ) return NULL;
+    *grown = (size < available) ? size : available - available % PAGE_SZ;
+    region = heap->end;
+    __atomic_store_n(&heap->end, heap->end + *grown, __ATOMIC_RELEASE);
+    heap->growths++;
+    return region;
+}
+
+// Return how much to grow a heap by when its wilderness block is deficit bytes too small: at least the deficit, the configured
+//      chunk and the configured percentage of the heap's current size, rounded up to a multiple of PAGE_SZ.
+size_t getGrowthSize(sf_heap* heap, size_t deficit){
+    size_t size = deficit;
+    size_t chunk = __atomic_load_n(&growChunk, __ATOMIC_RELAXED);
+    if (size < chunk) size = chunk;
+    size_t geometric = (size_t)(heap->end - heap->start) / 100 * __atomic_load_n(&growPercent, __ATOMIC_RELAXED);
+    if (size < geometric) size = geometric;
+    if (size > SIZE_MAX - PAGE_SZ) return SIZE_MAX - SIZE_MAX % PAGE_SZ;
+    return (size + PAGE_SZ - 1) / PAGE_SZ * PAGE_SZ;
+}
+
+// Record that the bytes of a heap before the given address may no longer be zero. Everything from heap->cleanFrom to the end
+//      of the heap is zero, except for the footer of the wilderness block and the epilogue. The header and links of the
+//      wilderness block are always before heap->cleanFrom, so that moving them never dirties memory that is thought clean.
+void markDirty(sf_heap* heap, void* until){
+    if (until > heap->cleanFrom) heap->cleanFrom = until;
+}
+
+// Return where the clean region (see markDirty) of the heap that contains the given address starts. For the tests.
+void* getHeapCleanFrom(void* p){
+    sf_heap* heap = heapOf(p);
+    pthread_mutex_lock(&heap->lock);
+    void* cleanFrom = heap->cleanFrom;
+    pthread_mutex_unlock(&heap->lock);
+    return cleanFrom;
+}
+
+// Push a block onto the remote-free queue of the heap that owns it. Any thread may do this w/o taking the heap's lock.
+// The block stays marked as allocated, so nothing coalesces w/ it until the heap drains the queue.
+void pushRemoteFree(sf_heap* heap, sf_block* block){
+    sf_block* head = __atomic_load_n(&heap->remoteFrees, __ATOMIC_RELAXED);
+    do {
+        block->body.links.next = head;
+    } while (!__atomic_compare_exchange_n(&heap->remoteFrees, &head, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Detach the whole remote-free queue of a heap. There is only one consumer at a time (the holder of the heap's lock), and it
+//      takes every block at once, so the queue cannot suffer from ABA.
+sf_block* takeRemoteFrees(sf_heap* heap){
+    if (__atomic_load_n(&heap->remoteFrees, __ATOMIC_RELAXED) == NULL) return NULL;
+    return __atomic_exchange_n(&heap->remoteFrees, NULL, __ATOMIC_ACQUIRE);
+}
+
+// -------------------------------------------------------------------------------------------------------------------------
 
 
 
 // Helper functions --------------------------------------------------------------------------------------------------------
+// Read the header of a block. The header of an allocated block can change under its owner while it reads it, as the thread that
+//      frees or allocates the block before it rewrites PREV_BLOCK_ALLOCATED (see setPrevBlockAllocated), so the reads that
+//      its owner makes w/o the heap's lock, and the writes of those bits, are relaxed atomics (plain moves on x86-64).
+sf_header readHeader(sf_block* block){
+    return __atomic_load_n(&block->header, __ATOMIC_RELAXED);
+}
+
 // Given a block, return the block size
 size_t getBlockSize(sf_block* block){
     int mask = 0xFFFFFFFF;
     mask = mask << 5;
-    return block->header & mask;
+    return readHeader(block) & mask;
 }
 
 // Given a blocksize, return the index of the free list that would be able to satisfy a request of specified size.
@@ -33,15 +275,51 @@ int findFirstValidFreeList(size_t blockSize){
     else return 6; // We stop here because, we only want to consider the wilderness block if this list is empty
 }
 
+// Given a request size, return the size of the block needed to hold it: header and payload, rounded up to a multiple of 32
+//      to maintain proper alignment. Allocated blocks have no footer (see PREV_BLOCK_ALLOCATED), so the payload may use the
+//      last row of the block.
+size_t getRequiredBlockSize(size_t size){
+    // Requests too large to round up can never be satisfied. Return the largest block size so that growing the heap fails.
+    if (size > SIZE_MAX - 8 - 31) return SIZE_MAX & ~(size_t)31;
+    return (8 + size + 31) & ~(size_t)31;
+}
+
 // Given a block, return address to footer
 sf_footer* getFooterAddress(sf_block* block){
     return (void*)block + getBlockSize(block) -8;
 }
 
-// Given an index representing one of the eight freelists, return 1 if the freelist is empty. 0, otherwise.
-int listIsEmpty(int i){
-    if (sf_free_list_heads[i].body.links.next == sf_free_list_heads[i].body.links.prev) return 1;
-    return 0;
+// Given a block, return the block that follows it in memory
+sf_block* getNextBlock(sf_block* block){
+    return (void*)block + getBlockSize(block);
+}
+
+// Return 1 if the block before the given block in memory is allocated. 0, otherwise.
+int prevBlockIsAllocated(sf_block* block){
+    return (readHeader(block) & PREV_BLOCK_ALLOCATED) != 0;
+}
+
+// Record in the header of a block whether the block before it in memory is allocated (and in its footer if it is free)
+void setPrevBlockAllocated(sf_block* block, int allocated){
+    sf_header header = readHeader(block);
+    header = allocated ? (header | PREV_BLOCK_ALLOCATED) : (header & ~(sf_header)PREV_BLOCK_ALLOCATED);
+    __atomic_store_n(&block->header, header, __ATOMIC_RELAXED);
+    if (!(header & THIS_BLOCK_ALLOCATED)) *getFooterAddress(block) = header;
+}
+
+// Given a block size (at most SEGMENTED_MAX_SIZE), set fl and sl to the segment of the segregated-fit index that holds free
+//      blocks of that size. Sizes below 1 << SEGMENT_FL_SHIFT go in row 0, one segment per multiple of 32. Sizes in
+//      [2^n, 2^(n+1)) go in row n - SEGMENT_FL_SHIFT + 1, which is split into SEGMENT_SL_COUNT equal segments.
+void getSegment(size_t size, int* fl, int* sl){
+    if (size < (1 << SEGMENT_FL_SHIFT)){
+        *fl = 0;
+        *sl = size / 32;
+    }
+    else{
+        int log2 = 63 - __builtin_clzl(size);
+        *fl = log2 - SEGMENT_FL_SHIFT + 1;
+        *sl = (size >> (log2 - SEGMENT_SL_LOG2)) - SEGMENT_SL_COUNT;
+    }
 }
 
 // Return 1 if splitting the block w/ a specific size will cause a splinter. 0, otherwise.
@@ -55,25 +333,23 @@ int splitWillSplinter(sf_block* block, size_t size){
 // The "upper part" (i.e. locations w/ higher-numbered addresses) becomes the remainder.
 sf_block* splitBlock(sf_block* block, size_t size){
     size_t originalBlockSize = getBlockSize(block);
-    // Split the block by updating header to have new size and updating footer in the new block
-    block->header = (size | THIS_BLOCK_ALLOCATED);
-    sf_footer* blockFooter = getFooterAddress(block);
-    *blockFooter = block->header;
-
-    // Create a new block w/ proper header, footer
-    sf_block* newBlock = (void*)block + getBlockSize(block);
-    newBlock->header = originalBlockSize - getBlockSize(block);
+    // Split the block by updating header to have new size (allocated blocks have no footer)
+    block->header = (size | THIS_BLOCK_ALLOCATED | (block->header & PREV_BLOCK_ALLOCATED));
+
+    // Create a new free block w/ proper header, footer. The block before it is the allocated lower part.
+    sf_block* newBlock = getNextBlock(block);
+    newBlock->header = (originalBlockSize - getBlockSize(block)) | PREV_BLOCK_ALLOCATED;
     sf_footer* newBlockFooter = getFooterAddress(newBlock);
     *newBlockFooter = newBlock->header;
 
     return newBlock;
 }
 
-// Coalescing function for sf_mem_grow because an attempt to coalesce the newly allocated page from the function call should
+// Coalescing function for heapGrow because an attempt to coalesce the newly allocated region of the given size should
 //      be made w/ the wilderness block in order to build blocks larger than one page.
-sf_block* coalesceBlockWithPage(sf_block* block){
+sf_block* coalesceBlockWithPage(sf_block* block, size_t size){
     // Update block header to be new size
-    block->header = getBlockSize(block) + PAGE_SZ;
+    block->header = (getBlockSize(block) + size) | (block->header & PREV_BLOCK_ALLOCATED);
 
     // Create new footer
     sf_footer* footerAddress = getFooterAddress(block);
@@ -87,7 +363,7 @@ sf_block* coalesceBlockWithBlock(sf_block* block1, sf_block* block2){
     // Cannot just blindly coalesce blocks. The new block always has to be the one that comes earlier in memory.
     if (block1 < block2){
     // Update block header to be new size
-        block1->header = getBlockSize(block1) + getBlockSize(block2);
+        block1->header = (getBlockSize(block1) + getBlockSize(block2)) | (block1->header & PREV_BLOCK_ALLOCATED);
 
         // Create new footer
         sf_footer* footerAddress = getFooterAddress(block1);
@@ -97,7 +373,7 @@ sf_block* coalesceBlockWithBlock(sf_block* block1, sf_block* block2){
     }
     else{
         // Update block header to be new size
-        block2->header = getBlockSize(block1) + getBlockSize(block2);
+        block2->header = (getBlockSize(block1) + getBlockSize(block2)) | (block2->header & PREV_BLOCK_ALLOCATED);
 
         // Create new footer
         sf_footer* footerAddress = getFooterAddress(block2);
@@ -107,78 +383,220 @@ sf_block* coalesceBlockWithBlock(sf_block* block1, sf_block* block2){
     }
 }
 
-// Given the index of an non-empty freelist, return pointer to first block in that list that is at least of size "size". NULL if none.
-sf_block* getFirstFit(int i, size_t size){
-    sf_block* firstNode = sf_free_list_heads[i].body.links.next;
-    // Check if first node is large enough to satisfy request
-    if (getBlockSize(firstNode) >= size){
-        return firstNode;
+// Free blocks in list NUM_FREE_LISTS-2 are at least 14M bytes, so besides the list links they have room for the links of a
+//      treap node, stored right after them in the payload. The treap is ordered by (size, address), and is a heap on a
+//      priority derived from the address, so that it stays balanced w/o storing anything else.
+typedef struct sf_tree_links {
+    sf_block* left;
+    sf_block* right;
+} sf_tree_links;
+
+sf_tree_links* getTreeLinks(sf_block* block){
+    return (void*)block + sizeof(sf_header) + 2 * sizeof(sf_block*);
+}
+
+unsigned int getTreePriority(sf_block* block){
+    return ((uintptr_t)block * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+// Return 1 if block1 comes before block2 in the treap: smaller, or the same size and lower in memory. 0, otherwise.
+int treeBefore(sf_block* block1, sf_block* block2){
+    size_t size1 = getBlockSize(block1), size2 = getBlockSize(block2);
+    return size1 < size2 || (size1 == size2 && block1 < block2);
+}
+
+// Split the treap at root into the nodes that come before key and the nodes that come after it
+void treeSplit(sf_block* root, sf_block* key, sf_block** before, sf_block** after){
+    if (root == NULL){
+        *before = NULL;
+        *after = NULL;
+    }
+    else if (treeBefore(root, key)){
+        *before = root;
+        treeSplit(getTreeLinks(root)->right, key, &getTreeLinks(root)->right, after);
+    }
+    else{
+        *after = root;
+        treeSplit(getTreeLinks(root)->left, key, before, &getTreeLinks(root)->left);
+    }
+}
+
+// Merge two treaps, where every node of the first comes before every node of the second
+sf_block* treeMerge(sf_block* before, sf_block* after){
+    if (before == NULL) return after;
+    if (after == NULL) return before;
+    if (getTreePriority(before) > getTreePriority(after)){
+        getTreeLinks(before)->right = treeMerge(getTreeLinks(before)->right, after);
+        return before;
+    }
+    getTreeLinks(after)->left = treeMerge(before, getTreeLinks(after)->left);
+    return after;
+}
+
+// Insert a block into the treap of the heap. Its size must not change until it is removed.
+void treeInsert(sf_heap* heap, sf_block* block){
+    // Walk down to where the block belongs by priority, then split the subtree there into its children
+    sf_block** link = &heap->treeRoot;
+    while (*link != NULL && getTreePriority(*link) > getTreePriority(block)){
+        link = treeBefore(block, *link) ? &getTreeLinks(*link)->left : &getTreeLinks(*link)->right;
+    }
+    treeSplit(*link, block, &getTreeLinks(block)->left, &getTreeLinks(block)->right);
+    *link = block;
+}
+
+// Remove a block from the treap of the heap, replacing it w/ the merge of its children
+void treeRemove(sf_heap* heap, sf_block* block){
+    sf_block** link = &heap->treeRoot;
+    while (*link != block){
+        link = treeBefore(block, *link) ? &getTreeLinks(*link)->left : &getTreeLinks(*link)->right;
     }
+    *link = treeMerge(getTreeLinks(block)->left, getTreeLinks(block)->right);
+}
 
-    // If not, repeat on the next nodes until the next node is the sentinel node. If next node is sentinel node, return NULL since we are at the end.
-    sf_block* nextNode = firstNode->body.links.next;
-    while (nextNode != &sf_free_list_heads[i]){
-        if (getBlockSize(nextNode) >= size){
-            return nextNode;
+// Return the smallest block in the treap that is at least "size" bytes (the lowest in memory among equals). NULL if none.
+sf_block* treeFindBestFit(sf_heap* heap, size_t size){
+    sf_block* bestFit = NULL;
+    sf_block* node = heap->treeRoot;
+    while (node != NULL){
+        if (getBlockSize(node) >= size){
+            bestFit = node;
+            node = getTreeLinks(node)->left;
+        }
+        else{
+            node = getTreeLinks(node)->right;
         }
-        sf_block* nextNode = nextNode->body.links.next;
     }
+    return bestFit;
+}
 
-    return NULL;
+// Return a free block of at least "size" bytes from the free lists 0..NUM_FREE_LISTS-2, or NULL if there is none.
+// Small requests take the first block of the smallest non-empty segment at or above their own size, in constant time.
+//      Every block in such a segment fits. Larger requests, and small ones that no segment can satisfy, take the best fit
+//      from the treap of list NUM_FREE_LISTS-2 in logarithmic time.
+sf_block* findFreeBlock(sf_heap* heap, size_t size){
+    if (size <= SEGMENTED_MAX_SIZE){
+        int fl, sl;
+        getSegment(size, &fl, &sl);
+        unsigned int slMap = heap->slBitmap[fl] & (~0u << sl);
+        if (slMap == 0){
+            uint64_t flMap = heap->flBitmap & (~(uint64_t)0 << (fl + 1));
+            if (flMap != 0){
+                fl = __builtin_ctzll(flMap);
+                slMap = heap->slBitmap[fl];
+            }
+        }
+        if (slMap != 0) return heap->segmentHeads[fl][__builtin_ctz(slMap)];
+    }
+    return treeFindBestFit(heap, size);
 }
 
 // Function that returns 1 if given block is free. Returns 0 otherwise.
 int blockIsFree(sf_block* block){
-    if (block->header == getBlockSize(block)) return 1;
+    if (!(readHeader(block) & THIS_BLOCK_ALLOCATED)) return 1;
     return 0;
 }
 
+// Keep count of the blocks in a free list of a heap, and of their size, as a block goes into it (delta 1) or out of it (-1)
+void countFreeBlock(sf_heap* heap, sf_block* block, int index, int delta){
+    heap->freeBlocks[index] += delta;
+    heap->freeBytes[index] += delta * getBlockSize(block);
+    heap->freeBytesTotal += delta * getBlockSize(block);
+}
+
+// Return how many bytes of a heap are in allocated blocks: its whole region but the free blocks, the padding at the start,
+//      the prologue and the epilogue
+size_t getHeapInUse(sf_heap* heap){
+    if (heap->start == heap->end) return 0;
+    return (heap->end - heap->start) - (24 + 32 + 8) - heap->freeBytesTotal;
+}
+
+// Record the bytes in use of a heap if they are the most so far. Called at the end of every allocation from a heap.
+void updatePeakInUse(sf_heap* heap){
+    size_t inUse = getHeapInUse(heap);
+    if (inUse > heap->peakInUse) heap->peakInUse = inUse;
+}
+
 // Function inserts the block to the front of the freelist at given index
-void insertIntoList(sf_block* block, int index){
+void insertIntoList(sf_heap* heap, sf_block* block, int index){
+    sf_block* sentinel = &heap->freeListHeads[index];
+    countFreeBlock(heap, block, index, 1);
     if (index == NUM_FREE_LISTS-1){ // If we are dealing with the wilderness free block
-        sf_free_list_heads[index].body.links.next = block;
-        sf_free_list_heads[index].body.links.prev = block;
+        sentinel->body.links.next = block;
+        sentinel->body.links.prev = block;
 
-        block->body.links.next = &sf_free_list_heads[index];
-        block->body.links.prev = &sf_free_list_heads[index];
+        block->body.links.next = sentinel;
+        block->body.links.prev = sentinel;
     }
-    else{ // Add block to the front of the list
+    else if (index == NUM_FREE_LISTS-2){ // Add block to the front of the list and to the treap
+        block->body.links.next = sentinel->body.links.next;
+        block->body.links.prev = sentinel;
+        sentinel->body.links.next->body.links.prev = block;
+        sentinel->body.links.next = block;
+        treeInsert(heap, block);
+    }
+    else{ // Add block to the front of its segment, or to the front of the list if the segment is empty
+        int fl, sl;
+        getSegment(getBlockSize(block), &fl, &sl);
+        sf_block* next = heap->segmentHeads[fl][sl];
+        if (next == NULL){
+            next = sentinel->body.links.next;
+            heap->slBitmap[fl] |= 1 << sl;
+            heap->flBitmap |= (uint64_t)1 << fl;
+        }
+
         // Set pointers of block
-        block->body.links.next = sf_free_list_heads[index].body.links.next;
-        block->body.links.prev = &sf_free_list_heads[index];
+        block->body.links.next = next;
+        block->body.links.prev = next->body.links.prev;
+
+        // The element before block and the element after block point to it
+        next->body.links.prev->body.links.next = block;
+        next->body.links.prev = block;
 
-        // Set pointers of the sentinel
-        // The old first element's prev points to block
-        sf_free_list_heads[index].body.links.next->body.links.prev = block;
-        // The first element is now block
-        sf_free_list_heads[index].body.links.next = block;
+        // Block is now the first element of its segment
+        heap->segmentHeads[fl][sl] = block;
     }
 }
 
 // Takes in a block and removes it from its freelist.
-void removeFromItsList(sf_block* block, int index){
+void removeFromItsList(sf_heap* heap, sf_block* block, int index){
+    countFreeBlock(heap, block, index, -1);
     // If wilderness block
     if (index == NUM_FREE_LISTS-1){
-        sf_free_list_heads[index].body.links.next = &sf_free_list_heads[index];
-        sf_free_list_heads[index].body.links.prev = &sf_free_list_heads[index];
+        heap->freeListHeads[index].body.links.next = &heap->freeListHeads[index];
+        heap->freeListHeads[index].body.links.prev = &heap->freeListHeads[index];
+        return;
+    }
+
+    if (index == NUM_FREE_LISTS-2){
+        treeRemove(heap, block);
     }
     else{
-        sf_block* previous = &sf_free_list_heads[index];
-        sf_block* current = previous->body.links.next;
-        while (current != block){
-            previous = current;
-            current = current->body.links.next;
+        // If block is the first element of its segment, the next element takes its place, unless it is in another segment
+        int fl, sl;
+        getSegment(getBlockSize(block), &fl, &sl);
+        if (heap->segmentHeads[fl][sl] == block){
+            sf_block* next = block->body.links.next;
+            int nextFl, nextSl;
+            getSegment(getBlockSize(next), &nextFl, &nextSl);
+            if (next != &heap->freeListHeads[index] && nextFl == fl && nextSl == sl){
+                heap->segmentHeads[fl][sl] = next;
+            }
+            else{
+                heap->segmentHeads[fl][sl] = NULL;
+                heap->slBitmap[fl] &= ~(1 << sl);
+                if (heap->slBitmap[fl] == 0) heap->flBitmap &= ~((uint64_t)1 << fl);
+            }
         }
-        // Remove
-        previous->body.links.next = current->body.links.next;
-        current->body.links.next->body.links.prev = previous;
     }
 
+    // Remove (the prev link makes this constant time)
+    block->body.links.prev->body.links.next = block->body.links.next;
+    block->body.links.next->body.links.prev = block->body.links.prev;
 }
 
 // Returns 1 if given block is wilderness block, 0 otherwise
-int isWildernessBlock(sf_block* block){
-    if (sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next == block) return 1;
+int isWildernessBlock(sf_heap* heap, sf_block* block){
+    if (heap->freeListHeads[NUM_FREE_LISTS-1].body.links.next == block) return 1;
     return 0;
 }
 
@@ -191,7 +609,10 @@ int pointerIsValid(void *p){
     if (p == NULL) return 0;
 
     // The pointer is not 32-byte aligned
-    // if (((uintptr_t)pp - 8) % 32 != 0) return 0; // TODO / FIX ---------------------------------------------------------------------------------------
+    if ((uintptr_t)p % 32 != 0) return 0;
+
+    // The header of the block is not inside any heap
+    if (heapOf(block) == NULL) return 0;
 
     // The block size is less than the minimum block size of 32
     if (getBlockSize(block) < 32) return 0;
@@ -199,317 +620,227 @@ int pointerIsValid(void *p){
     // The block size is not a multiple of 32
     if (getBlockSize(block) % 32 != 0) return 0;
 
-    // The header of the block is before the start of the first block of the heap/ or the footer of the block is after the end of the last block in the heap
-    // if (pp < sf_mem_start() || (void*)getFooterAddress(block) > sf_mem_end()) return 0; // TODO / FIX ---------------------------------------------------
+    // The end of the block is after the end of the last block in the heap
+    if (heapOf(getFooterAddress(block)) != heapOf(block)) return 0;
 
     // The allocated bit in the header is 0
-    if (block->header == getBlockSize(block)) return 0;
+    if (blockIsFree(block)) return 0;
 
     return 1;
 }
 
-// -------------------------------------------------------------------------------------------------------------------------
-
-
-
-/*
- * This is your implementation of sf_malloc. It acquires uninitialized memory that
- * is aligned and padded properly for the underlying system.
- *
- * @param size The number of bytes requested to be allocated.
- *
- * @return If size is 0, then NULL is returned without setting sf_errno.
- * If size is nonzero, then if the allocation is successful a pointer to a valid region of
- * memory of the requested size is returned.  If the allocation is not successful, then
- * NULL is returned and sf_errno is set to ENOMEM.
- */
-
-void *sf_malloc(size_t size) {
-    // Check if request size is 0. If so, return NULL without setting sf_errno.
-    if (size == 0){
-        return NULL;
+// Set up the prologue, epilogue and initial wilderness block of a heap. Returns 0 on success, -1 if no memory is available.
+int initHeap(sf_heap* heap){
+    // Initialize the head of each free list by setting the next and prev pointers of the sentinel node to point back to the node itself.
+    for (int i=0; i<NUM_FREE_LISTS; i++){
+        heap->freeListHeads[i].body.links.next = &heap->freeListHeads[i];
+        heap->freeListHeads[i].body.links.prev = &heap->freeListHeads[i];
     }
+    // Every segment of the segregated-fit index starts out empty
+    heap->flBitmap = 0;
+    memset(heap->slBitmap, 0, sizeof(heap->slBitmap));
+    memset(heap->segmentHeads, 0, sizeof(heap->segmentHeads));
+    heap->treeRoot = NULL;
+
+    // Obtain a page of memory within which to set up the prologue & epilogue w/ specified padding.
+    // The remainder memory in this first page should then be inserted into the wilderness block as
+    //      a single free block w/ normal header & footers, and next & prev pointers point to the wilderness sentinel.
+    size_t grown;
+    void* additionalPage = heapGrow(heap, PAGE_SZ, &grown);
+    if (additionalPage == NULL) return -1; // If there is no available memory left
+
+    // The heap begins with unused "padding"
+    // Set up first block of the heap, the prologue. This is an allocated block of minimum size (1M) w/ an unused payload area.
+    // Set up header & footer. Address of footer: header address + block size - 8
+    sf_block* prologue = additionalPage + 24;
+    prologue->header = (32 | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED);
+    sf_footer *prologueFooterAddress = getFooterAddress(prologue);
+    *prologueFooterAddress = prologue->header;
+
+    // Set up epilogue, which consists only of an allocated header, with block size set to 0. The block before it is free.
+    sf_block* epilogue = additionalPage + PAGE_SZ - 8;
+    epilogue->header = (0 | THIS_BLOCK_ALLOCATED);
+
+    // Set wilderness block header & footer
+    sf_block* wildernessFreeBlock = additionalPage + 24 + getBlockSize(prologue);
+    wildernessFreeBlock->header = (PAGE_SZ - 24 - getBlockSize(prologue) - 8) | PREV_BLOCK_ALLOCATED;
+    sf_footer *wildernessFooterAddress = getFooterAddress(wildernessFreeBlock);
+    *wildernessFooterAddress = wildernessFreeBlock->header;
+    markDirty(heap, (void*)wildernessFreeBlock + 32);
+
+    // Insert remainder memory as free block into wilderness freelist
+    insertIntoList(heap, wildernessFreeBlock, NUM_FREE_LISTS-1);
+    return 0;
+}
 
-    // If heap has not been initialized (first call to sf_malloc).
-    if (sf_mem_start() == sf_mem_end()){
-        // Initialize the head of each free list in sf_free_list_heads by setting the next and prev pointers of the
-        //      sentinel node to point back to the node itself.
-
-        for (int i=0; i<NUM_FREE_LISTS; i++){
-            sf_free_list_heads[i].body.links.next = &sf_free_list_heads[i];
-            sf_free_list_heads[i].body.links.prev = &sf_free_list_heads[i];
-        }
-
-        // Make a call to sf_mem_grow to obtain a page of memory within which to set up the prologue & epilogue w/ specified padding.
-        // The remainder memory in this first page should then be inserted into the wilderness block as
-        //      a single free block w/ normal header & footers, and next & prev pointers point to sf_free_list_heads[NUM_FREE_LISTS-1]
-
-        void* additionalPage = sf_mem_grow();
-        void* currentAddress = additionalPage;
-
-        if (additionalPage == NULL){ // If there is no available memory left
-            sf_errno = ENOMEM;
-            return NULL;
-        }
-        else{
-            // The heap begins with unused "padding"
-            currentAddress += 24;
-
-            // Set up first block of the heap, the prologue. This is an allocated block of minimum size (1M) w/ an unused payload area.
-            // Set up header & footer. Address of footer: header address + block size - 8
-            sf_block* prologue = currentAddress;
-            prologue->header = (32 | THIS_BLOCK_ALLOCATED);
-            sf_footer *prologueFooterAddress = getFooterAddress(prologue);
-            *prologueFooterAddress = prologue->header;
-
-            // Set up epilogue, which consists only of an allocated header, with block size set to 0.
-            sf_block* epilogue = additionalPage + PAGE_SZ - 8;
-            epilogue->header = (0 | THIS_BLOCK_ALLOCATED);
-
-            // Set wilderness block header & footer
-            sf_block* wildernessFreeBlock = additionalPage + 24 + getBlockSize(prologue);
-            wildernessFreeBlock->header = PAGE_SZ - 24 - getBlockSize(prologue) - getBlockSize(epilogue);
-            sf_footer *wildernessFooterAddress = getFooterAddress(wildernessFreeBlock);
-            *wildernessFooterAddress = wildernessFreeBlock->header;
-
-            // Set wilderness block next & prev pointers
-            wildernessFreeBlock->body.links.prev = &sf_free_list_heads[NUM_FREE_LISTS-1];
-            wildernessFreeBlock->body.links.next = &sf_free_list_heads[NUM_FREE_LISTS-1];
+// Allocate a block of requiredBlockSize out of a free block, which is removed from the freelist at the given index.
+// The block is split if that will not leave a splinter. The remainder goes back into the appropriate freelist, or stays the
+//      wilderness block if it came from the wilderness block.
+void* allocateFromFreeBlock(sf_heap* heap, sf_block* block, int index, size_t requiredBlockSize){
+    removeFromItsList(heap, block, index);
 
-            // Insert remainder memory as free block into wilderness freelist
-            sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next = wildernessFreeBlock;
-            sf_free_list_heads[NUM_FREE_LISTS-1].body.links.prev = wildernessFreeBlock;
-        }
+    if (splitWillSplinter(block, requiredBlockSize)){  // Allocate whole block
+        // Set the allocated bit of the block, and tell the next block that the block before it is now allocated
+        block->header |= THIS_BLOCK_ALLOCATED;
+        setPrevBlockAllocated(getNextBlock(block), 1);
     }
-
-    // Determine the size of the block to be allocated by adding the header size, footer size, and the size of any necessary padding
-    //      to reach a size that is a multiple of 32 to maintain proper alignment.
-    size_t calculatedSize = 8 + size + 8;
-    size_t requiredBlockSize = 0;
-    while (requiredBlockSize < calculatedSize){
-        requiredBlockSize += 32;
-    }
-
-    // Determine the index of the free list that would be able to satisfy a request of specified size..
-    int index = findFirstValidFreeList(requiredBlockSize);
-    while (index < NUM_FREE_LISTS-1){
-        if (!listIsEmpty(index)){
-            // List is not empty. Now, search current free list from beginning until the first sufficiently large block is found.
-            sf_block* firstValidBlock = getFirstFit(index, requiredBlockSize);
-
-            // If a big enough block is found, then after splitting it (if it will not leave a splinter), insert the remainder part back
-            //      into the appropriate freelist. Allocate the block & return pointer to header. Make sure to remove the current block from its free list.
-            // Will reuse code from below. Should implement as its own function.
-            if (firstValidBlock != NULL){
-                if (splitWillSplinter(firstValidBlock, requiredBlockSize)){  // Allocate whole block
-                    // Set the allocated bit of the block to 0
-                   firstValidBlock->header = (getBlockSize(firstValidBlock) | THIS_BLOCK_ALLOCATED);
-
-                    // Remove the free block from its free list
-                    sf_free_list_heads[index].body.links.next = &sf_free_list_heads[index];
-                    sf_free_list_heads[index].body.links.prev = &sf_free_list_heads[index];
-
-                    // Return pointer to valid region of memory of requested size
-                    return firstValidBlock->body.payload;
-                }
-                else{
-                    // Split block
-                    sf_block* remainderBlock = splitBlock(firstValidBlock, requiredBlockSize);
-
-                    // Set pointers in the remainderBlock to the head of sentinel
-                    remainderBlock->body.links.next = &sf_free_list_heads[index];
-                    remainderBlock->body.links.prev = &sf_free_list_heads[index];
-
-                    // Insert the remainder part back into the appropriate freelist
-                    int newIndex = findFirstValidFreeList(getBlockSize(remainderBlock));
-                    sf_free_list_heads[newIndex].body.links.next = remainderBlock;
-                    sf_free_list_heads[newIndex].body.links.prev = remainderBlock;
-
-                    // Return pointer to valid region of memory of requested size
-                    return firstValidBlock->body.payload;
-                }
-            }
-
-            // If there is no such block, continue w/ the next larger size class, until a nonempty list is found.
-        }
-        index++;
+    else{
+        // Split block, then insert the remainder part back into the appropriate freelist
+        sf_block* remainderBlock = splitBlock(block, requiredBlockSize);
+        heap->splits++;
+        if (index == NUM_FREE_LISTS-1) insertIntoList(heap, remainderBlock, NUM_FREE_LISTS-1);
+        else insertIntoList(heap, remainderBlock, findFirstValidFreeList(getBlockSize(remainderBlock)));
     }
+    updatePeakInUse(heap);
 
-    if (index == 7){ // Wilderness block must be used to satisfy request since the previous lists were all empty
-        // if wilderness block is large enough to satisfy the request
-        sf_block* wildernessFreeBlock = sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next;
-        int wildernessBlockSize = getBlockSize(wildernessFreeBlock);
-        if (wildernessBlockSize >= requiredBlockSize){
-            // Satisfy request depending on whether splitting it will create a splinter or not
-            if (splitWillSplinter(wildernessFreeBlock, requiredBlockSize)){  // Allocate whole block
-                // Set the allocated bit of the block to 0
-                wildernessFreeBlock->header = (getBlockSize(wildernessFreeBlock) | THIS_BLOCK_ALLOCATED);
+    // The block can now be written to, and so can the header and links of the new wilderness block after it
+    if (index == NUM_FREE_LISTS-1) markDirty(heap, (void*)getNextBlock(block) + 32);
 
-                // Remove the free block from the wilderness free list
-                sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next = &sf_free_list_heads[NUM_FREE_LISTS-1];
-                sf_free_list_heads[NUM_FREE_LISTS-1].body.links.prev = &sf_free_list_heads[NUM_FREE_LISTS-1];
+    // Return pointer to valid region of memory of requested size
+    return block->body.payload;
+}
 
-                // Return pointer to valid region of memory of requested size
-                return wildernessFreeBlock->body.payload;
-            }
-            else{
-                // Split block
-                sf_block* remainderBlock = splitBlock(wildernessFreeBlock, requiredBlockSize);
-
-                // Set pointers in the remainderBlock. Since it will be the new wilderness free block, set its pointers to the head of sentinel
-                remainderBlock->body.links.next = &sf_free_list_heads[NUM_FREE_LISTS-1];
-                remainderBlock->body.links.prev = &sf_free_list_heads[NUM_FREE_LISTS-1];
-
-                // Insert the remainder part back into the appropriate freelist (back into the wilderness free list block)
-                sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next = remainderBlock;
-                sf_free_list_heads[NUM_FREE_LISTS-1].body.links.prev = remainderBlock;
-
-                // printf("Address of block/header: %p\n", wildernessFreeBlock);
-                // printf("Returned address (to payload): %p\n\n", (void*)wildernessFreeBlock + sizeof(sf_header));
-                // Return pointer to valid region of memory of requested size
-                // sf_show_block(wildernessFreeBlock);
-                return wildernessFreeBlock->body.payload;
-            }
+// Grow the heap so that the wilderness block (after coalescing the newly allocated region w/ it) is large enough to satisfy a
+//      request of requiredBlockSize. The deficit is computed up front, so the heap grows and the boundary tags are rewritten
+//      once. Returns 0 on success, -1 if out of memory (the heap keeps whatever it managed to grow by).
+int growWilderness(sf_heap* heap, size_t requiredBlockSize){
+    sf_block* wildernessSentinel = &heap->freeListHeads[NUM_FREE_LISTS-1];
+    sf_block* wildernessBlock = NULL;
+    if (wildernessSentinel->body.links.next != wildernessSentinel) wildernessBlock = wildernessSentinel->body.links.next;
+
+    // The old epilogue becomes the header of the new region. If the wilderness list is empty but the block before the epilogue
+    //      is free, that block will be merged w/ the new region, so it counts towards the request too.
+    sf_block* oldEpilogue = heap->end - 8;
+    size_t available = 0;
+    if (wildernessBlock != NULL) available = getBlockSize(wildernessBlock);
+    else if (!prevBlockIsAllocated(oldEpilogue)) available = *(sf_footer*)((void*)oldEpilogue - 8) & ~0x1f;
+    if (requiredBlockSize <= available) return 0;
+    size_t deficit = requiredBlockSize - available;
+
+    size_t grown;
+    void* region = heapGrow(heap, getGrowthSize(heap, deficit), &grown);
+
+    // If allocator cannot satisfy the request
+    if (region == NULL) return -1;
+
+    if (wildernessBlock != NULL){
+        // Coalesce the wilderness free block with new region (this also writes the footer at the end of the new region)
+        coalesceBlockWithPage(wildernessBlock, grown);
+        heap->freeBytes[NUM_FREE_LISTS-1] += grown;
+        heap->freeBytesTotal += grown;
+
+        // The old footer and epilogue are now in the middle of the wilderness block
+        void* staleTags = ((void*)oldEpilogue - 8 > heap->cleanFrom) ? (void*)oldEpilogue - 8 : heap->cleanFrom;
+        if (staleTags < region) memset(staleTags, 0, region - staleTags);
+    }
+    else{
+        // The wilderness free list is empty, so the newly allocated region should be the new wilderness block.
+        sf_block* newWildernessBlock = oldEpilogue;
+        newWildernessBlock->header = grown | (oldEpilogue->header & PREV_BLOCK_ALLOCATED);
+        *getFooterAddress(newWildernessBlock) = newWildernessBlock->header;
+
+        // If the block before the new region is free, it is now adjacent to the wilderness and must be merged into it
+        if (!prevBlockIsAllocated(newWildernessBlock)){
+            sf_footer* prevBlockFooter = (void*)newWildernessBlock - 8;
+            sf_block* prevBlock = (void*)newWildernessBlock - (*prevBlockFooter & ~0x1f);
+            removeFromItsList(heap, prevBlock, findFirstValidFreeList(getBlockSize(prevBlock)));
+            newWildernessBlock = coalesceBlockWithBlock(prevBlock, newWildernessBlock);
+            heap->coalesces++;
         }
-        else{
-            // if the wilderness block is not already large enough to satisfy the request
-            // call sf_mem_grow until either the allocator cannot satisfy the request, or if after coalescing the newly allocated page
-            //      w/ the free block in the wilderness free list (if any), is large enough to satisfy request
-
-            // while the wilderness block free list is empty or while the wilderness free block is not large enough
-            while (sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next == &sf_free_list_heads[NUM_FREE_LISTS-1] ||
-                requiredBlockSize > getBlockSize(sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next)){
-
-                void* requestedPage = sf_mem_grow();
-
-                // If allocator cannot satisfy the request
-                if (requestedPage == NULL){
-                    sf_errno = ENOMEM;
-                    return NULL;
-                }
-
-                // Check if the wilderness free list is empty. If so, the newly allocated page should be the new wilderness block.
-                if (sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next == &sf_free_list_heads[NUM_FREE_LISTS-1] &&
-                    sf_free_list_heads[NUM_FREE_LISTS-1].body.links.prev == &sf_free_list_heads[NUM_FREE_LISTS-1]){
-                    sf_block* newWildernessBlock = requestedPage;
-
-                    // Set header and footer
-                    newWildernessBlock->header = PAGE_SZ;
-                    sf_footer* newWildernessBlockFooter = getFooterAddress(newWildernessBlock);
-                    *newWildernessBlockFooter = newWildernessBlock->header;
-
-                    // Set links
-                    newWildernessBlock->body.links.next = &sf_free_list_heads[NUM_FREE_LISTS-1];
-                    newWildernessBlock->body.links.prev = &sf_free_list_heads[NUM_FREE_LISTS-1];
-
-                    // Set new epilogue
-                    sf_block* epilogue = requestedPage - 8;
-                    epilogue->header = (0 | THIS_BLOCK_ALLOCATED);
-                }
-                else{
-                    // Coalesce the wilderness free block with new page
-                    sf_block* newBlock = coalesceBlockWithPage(sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next);
-
-                    // Old epilogue as header of new block
-                    sf_block* oldEpilogue = (void*)sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next + getBlockSize(sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next);
-                    oldEpilogue->header = getBlockSize(newBlock);
-
-                    // Set footer
-                    sf_footer* footer = getFooterAddress(newBlock);
-                    *footer = getBlockSize(newBlock);
-
-                    // Create new epilogue at the end of the newly added region
-                    sf_block* newEpilogue = (void*)newBlock + getBlockSize(newBlock);
-                    newEpilogue->header = (0 | THIS_BLOCK_ALLOCATED);
-
-                    // Insert the new block at the beginning of the appropriate freelist (always the wilderness block)
-                    sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next = newBlock;
-                    sf_free_list_heads[NUM_FREE_LISTS-1].body.links.prev = newBlock;
-                }
-            }
-
-            // Satisfy the request now that the wilderness block is large enough
-            // MAKE MODULAR. THE IF AND ELSE STATEMENT BELOW IS THE SAME AS ABOVE (IF WILDERNESS BLOCK WAS LARGE ENOUGH W/O CALLING SF_MEM_GROW)
-            if (splitWillSplinter(wildernessFreeBlock, requiredBlockSize)){  // Allocate whole block
-                // Set the allocated bit of the block to 0
-                wildernessFreeBlock->header = (getBlockSize(wildernessFreeBlock) | THIS_BLOCK_ALLOCATED);
-
-                // Remove the free block from the wilderness free list
-                sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next = &sf_free_list_heads[NUM_FREE_LISTS-1];
-                sf_free_list_heads[NUM_FREE_LISTS-1].body.links.prev = &sf_free_list_heads[NUM_FREE_LISTS-1];
-
-                // Return pointer to valid region of memory of requested size
-                return wildernessFreeBlock->body.payload;
-            }
-            else{
-                // Split block
-                sf_block* remainderBlock = splitBlock(wildernessFreeBlock, requiredBlockSize);
+        insertIntoList(heap, newWildernessBlock, NUM_FREE_LISTS-1);
+        markDirty(heap, (void*)oldEpilogue + 32);
+    }
 
-                // Set pointers in the remainderBlock. Since it will be the new wilderness free block, set its pointers to the head of sentinel
-                remainderBlock->body.links.next = &sf_free_list_heads[NUM_FREE_LISTS-1];
-                remainderBlock->body.links.prev = &sf_free_list_heads[NUM_FREE_LISTS-1];
+    // Create new epilogue at the end of the newly added region (the wilderness block before it is free)
+    sf_block* newEpilogue = region + grown - 8;
+    newEpilogue->header = (0 | THIS_BLOCK_ALLOCATED);
 
-                // Insert the remainder part back into the appropriate freelist (back into the wilderness free list block)
-                sf_free_list_heads[NUM_FREE_LISTS-1].body.links.next = remainderBlock;
-                sf_free_list_heads[NUM_FREE_LISTS-1].body.links.prev = remainderBlock;
+    if (grown < deficit) return -1;
+    return 0;
+}
 
-                // Return pointer to valid region of memory of requested size
-                return wildernessFreeBlock->body.payload;
-            }
-        }
+// Give the whole OS pages of the wilderness block of a heap beyond its first keep bytes back to the OS. The mmap'ed heaps move
+//      their end back to the last page kept, along w/ the epilogue. Heap 0 cannot shrink (sfutil has no way to), so its pages
+//      are only discarded, and fault back in as zeroes when the wilderness block is used again. Called w/ the heap's lock
+//      held. Returns the number of bytes released.
+#define TRIM_ALIGN 4096
+size_t trimHeap(sf_heap* heap, size_t keep){
+    sf_block* wildernessSentinel = &heap->freeListHeads[NUM_FREE_LISTS-1];
+    if (wildernessSentinel->body.links.next == wildernessSentinel) return 0;
+    sf_block* wildernessBlock = wildernessSentinel->body.links.next;
+
+    // Keep the header, the links and the footer of the wilderness block, and the first keep bytes of it
+    if (keep < 32) keep = 32;
+    if (keep > getBlockSize(wildernessBlock)) return 0;
+    uintptr_t firstReleased = ((uintptr_t)wildernessBlock + keep + 8 + TRIM_ALIGN - 1) & ~(uintptr_t)(TRIM_ALIGN - 1);
+
+#ifndef SF_STANDALONE
+    if (heap == &heaps[0]){
+        uintptr_t lastReleased = ((uintptr_t)getFooterAddress(wildernessBlock)) & ~(uintptr_t)(TRIM_ALIGN - 1);
+        if (lastReleased <= firstReleased) return 0;
+        madvise((void*)firstReleased, lastReleased - firstReleased, MADV_DONTNEED);
+        return lastReleased - firstReleased;
     }
-
-    return NULL;
+#endif
+
+    if (firstReleased >= (uintptr_t)heap->end) return 0;
+    size_t released = (uintptr_t)heap->end - firstReleased;
+    void* newEnd = (void*)firstReleased;
+
+    // Shrink the wilderness block so that it ends right before the new epilogue
+    wildernessBlock->header = (newEnd - 8 - (void*)wildernessBlock) | (wildernessBlock->header & PREV_BLOCK_ALLOCATED);
+    *getFooterAddress(wildernessBlock) = wildernessBlock->header;
+    heap->freeBytes[NUM_FREE_LISTS-1] -= released;
+    heap->freeBytesTotal -= released;
+    sf_block* newEpilogue = newEnd - 8;
+    newEpilogue->header = (0 | THIS_BLOCK_ALLOCATED);
+
+    __atomic_store_n(&heap->end, newEnd, __ATOMIC_RELEASE);
+    madvise(newEnd, released, MADV_DONTNEED);
+    if (heap->cleanFrom > newEnd) heap->cleanFrom = newEnd;
+    return released;
 }
 
-/*
- * Marks a dynamically allocated region as no longer in use.
- * Adds the newly freed block to the free list.
- *
- * @param ptr Address of memory returned by the function sf_malloc.
- *
- * If ptr is invalid, the function calls abort() to exit the program.
- */
-
-void sf_free(void *pp) {
-    if (!pointerIsValid(pp)) abort();
-    sf_block* block = (sf_block*)(pp - sizeof(sf_header));
-
-    // Pointer given is valid, so free the block.
-    // Get pointers to adjacent blocks
-    sf_footer* prevBlockFooter = (void*)block - 8;
-    int mask = 0xFFFFFFFF;
-    mask = mask << 5;
-    size_t prevBlockSize = *prevBlockFooter & mask;
-    sf_block* prevBlock = (void*)block - prevBlockSize;
-    sf_block* nextBlock = (void*)block + getBlockSize(block);
+// Coalesce a block w/ any adjacent free blocks and insert the result into the appropriate freelist of the heap.
+// Called w/ the heap's lock held.
+void freeBlock(sf_heap* heap, sf_block* block){
+    // Get pointers to adjacent blocks. Only a free block before this one has a footer to find it by.
+    sf_block* prevBlock = NULL;
+    if (!prevBlockIsAllocated(block)){
+        sf_footer* prevBlockFooter = (void*)block - 8;
+        int mask = 0xFFFFFFFF;
+        mask = mask << 5;
+        size_t prevBlockSize = *prevBlockFooter & mask;
+        prevBlock = (void*)block - prevBlockSize;
+    }
+    sf_block* nextBlock = getNextBlock(block);
 
     int coalescedBlockIsWilderness = 0;
 
     // If the adjacent blocks are in the heap, attempt to coalesce. If coalesced, remove the block from its free list.
-    if ((void*)prevBlock >= sf_mem_start() && (void*)prevBlock <= sf_mem_end()){
-        if (blockIsFree(prevBlock)){
-            if (isWildernessBlock(prevBlock)){
-                coalescedBlockIsWilderness = 1;
-                removeFromItsList(prevBlock, NUM_FREE_LISTS-1);
-            }
-            else{
-                removeFromItsList(prevBlock, findFirstValidFreeList(getBlockSize(prevBlock)));
-            }
-            block = coalesceBlockWithBlock(block, prevBlock);
+    if (prevBlock != NULL && (void*)prevBlock >= heap->start && (void*)prevBlock < heap->end){
+        if (isWildernessBlock(heap, prevBlock)){
+            coalescedBlockIsWilderness = 1;
+            removeFromItsList(heap, prevBlock, NUM_FREE_LISTS-1);
+        }
+        else{
+            removeFromItsList(heap, prevBlock, findFirstValidFreeList(getBlockSize(prevBlock)));
         }
+        block = coalesceBlockWithBlock(block, prevBlock);
+        heap->coalesces++;
     }
 
-    if ((void*)nextBlock >= sf_mem_start() && (void*)nextBlock <= sf_mem_end()){
+    if ((void*)nextBlock >= heap->start && (void*)nextBlock < heap->end){
         if (blockIsFree(nextBlock)){
-            if (isWildernessBlock(nextBlock)){
+            if (isWildernessBlock(heap, nextBlock)){
                 coalescedBlockIsWilderness = 1;
-                removeFromItsList(nextBlock, NUM_FREE_LISTS-1);
+                removeFromItsList(heap, nextBlock, NUM_FREE_LISTS-1);
             }
             else{
-                removeFromItsList(nextBlock, findFirstValidFreeList(getBlockSize(nextBlock)));
+                removeFromItsList(heap, nextBlock, findFirstValidFreeList(getBlockSize(nextBlock)));
             }
             block = coalesceBlockWithBlock(block, nextBlock);
+            heap->coalesces++;
         }
     }
 
@@ -522,136 +853,1447 @@ void sf_free(void *pp) {
         appropriateFreeListIndex = findFirstValidFreeList(getBlockSize(block));
     }
 
-    insertIntoList(block, appropriateFreeListIndex);
+    insertIntoList(heap, block, appropriateFreeListIndex);
 
     // Blocks in a free list must not be marked as allocated (so change the allocation bit) and must have a valid footer w/ contents identical to header
-    block->header = getBlockSize(block);
+    block->header &= ~(sf_header)THIS_BLOCK_ALLOCATED;
     sf_footer* footer = getFooterAddress(block);
     *footer = block->header;
+
+    // The block after it must know that it is now preceded by a free block
+    setPrevBlockAllocated(getNextBlock(block), 0);
+
+    // Once the wilderness block grows past the trim threshold, give all of it but one growth chunk back to the OS
+    size_t threshold = __atomic_load_n(&trimThreshold, __ATOMIC_RELAXED);
+    if (coalescedBlockIsWilderness && threshold > 0 && getBlockSize(block) > threshold){
+        trimHeap(heap, __atomic_load_n(&growChunk, __ATOMIC_RELAXED));
+    }
 }
 
+// -------------------------------------------------------------------------------------------------------------------------
 
-/*
- * Resizes the memory pointed to by ptr to size bytes.
- *
- * @param ptr Address of the memory region to resize.
- * @param size The minimum size to resize the memory to.
- *
- * @return If successful, the pointer to a valid region of memory is
- * returned, else NULL is returned and sf_errno is set appropriately.
- *
- *   If sf_realloc is called with an invalid pointer sf_errno should be set to EINVAL.
- *   If there is no memory available sf_realloc should set sf_errno to ENOMEM.
- *
- * If sf_realloc is called with a valid pointer and a size of 0 it should free
- * the allocated block and return NULL without setting sf_errno.
- */
 
-void *sf_realloc(void *pp, size_t rsize) {
-    if (!pointerIsValid(pp)){
-        sf_errno = EINVAL;
-        return NULL;
+
+// Deferred coalescing -----------------------------------------------------------------------------------------------------
+// W/ SF_OPT_DEFER_COALESCING, a heap keeps the small blocks freed into it in quick lists, one per block size, rather than
+//      coalesce them at once only to split them again when the same size is allocated next. A quick-listed block stays marked
+//      as allocated, so that its neighbors do not coalesce w/ it either. The quick lists are coalesced in one batch when they
+//      hold too many blocks, when an allocation finds no fit, and before a trim.
+#define QUICK_KEY ((sf_block*)&deferredCount)      // Stored in body.links.prev of quick-listed blocks to catch double frees
+
+static size_t deferredCount = 0;                    // Blocks a heap may hold in its quick lists, 0 disables them. Set by sf_mallopt
+
+// Coalesce every block in the quick lists of a heap into its free lists. Called w/ the heap's lock held.
+void coalesceQuickLists(sf_heap* heap){
+    for (int i=0; i<QUICK_LISTS && heap->quickCount > 0; i++){
+        sf_block* block = heap->quickLists[i];
+        heap->quickLists[i] = NULL;
+        while (block != NULL){
+            sf_block* next = block->body.links.next;
+            heap->quickCount--;
+            freeBlock(heap, block);
+            block = next;
+        }
     }
-    if (false /* TODO */){     // If there is no memory available sf_realloc should set sf_errno to ENOMEM
-        sf_errno = ENOMEM;
-        return NULL;
+}
+
+// Take a block of exactly blockSize bytes from the quick lists of a heap. NULL if there is none. Called w/ the heap's lock held.
+sf_block* takeFromQuickList(sf_heap* heap, size_t blockSize){
+    if (heap->quickCount == 0 || blockSize > QUICK_MAX_BLOCK_SIZE) return NULL;
+    int list = blockSize / 32 - 1;
+    sf_block* block = heap->quickLists[list];
+    if (block != NULL){
+        heap->quickLists[list] = block->body.links.next;
+        heap->quickCount--;
+        block->body.links.prev = NULL;
     }
-    if (rsize == 0){
-        sf_free(pp);
-        return NULL;
+    return block;
+}
+
+// Free an allocated block into a heap: into a quick list if coalescing is deferred and the block is small enough, or else
+//      coalesced into the free lists. Called w/ the heap's lock held.
+void releaseBlock(sf_heap* heap, sf_block* block){
+    size_t maxCount = __atomic_load_n(&deferredCount, __ATOMIC_RELAXED);
+    if (maxCount == 0 || getBlockSize(block) > QUICK_MAX_BLOCK_SIZE){
+        freeBlock(heap, block);
+        return;
     }
+    int list = getBlockSize(block) / 32 - 1;
 
-    size_t totalSize = rsize + sizeof(sf_header) + sizeof(sf_footer);
-    size_t requiredBlockSize = 0;
-    while (requiredBlockSize < totalSize){
-        requiredBlockSize += 32;
+    // A block that carries the key might already be in the quick list. Freeing it again would corrupt the list.
+    if (block->body.links.prev == QUICK_KEY){
+        for (sf_block* quick = heap->quickLists[list]; quick != NULL; quick = quick->body.links.next){
+            if (quick == block) abort();
+        }
     }
+    block->body.links.next = heap->quickLists[list];
+    block->body.links.prev = QUICK_KEY;
+    heap->quickLists[list] = block;
+    if (++heap->quickCount > maxCount) coalesceQuickLists(heap);
+}
 
-    sf_block* block = (sf_block*)(pp - sizeof(sf_header));
-    // Return pointer to a valid region of memory
-    if (getBlockSize(block) == requiredBlockSize) return pp;
+// -------------------------------------------------------------------------------------------------------------------------
 
-    // If reallocating to a larger size.
-    if (getBlockSize(block) < requiredBlockSize){
-        void* largerBlock = sf_malloc(rsize);
-        if (largerBlock == NULL) return NULL;
-        memcpy(largerBlock, pp, rsize);
-        sf_free(pp);
-        return largerBlock;
-    }
 
-    // Reallocating to a smaller size
-    // Case with splinter: do nothing
-    // Case with splinter:
 
-    if (!splitWillSplinter(block, totalSize)){
-        // Split the block and update the block size fields in both headers
-        sf_block* remainderBlock = splitBlock(block, requiredBlockSize);
+// Free, in one batch, every block that other threads pushed onto the heap's remote-free queue. Called w/ the heap's lock held.
+void drainRemoteFrees(sf_heap* heap){
+    sf_block* block = takeRemoteFrees(heap);
+    while (block != NULL){
+        sf_block* next = block->body.links.next;
+        releaseBlock(heap, block);
+        block = next;
+    }
+}
 
-        // Free remainder block
-        // Copied code from sf_free function, since that function cant be reused because it can only be used on pointers that were
-        //      returned by malloc;
-        sf_block* block = remainderBlock;
+// Body of sf_malloc, called w/ the heap's lock held. Returns NULL if no memory is available.
+void* heapMalloc(sf_heap* heap, size_t requiredBlockSize){
+    // If heap has not been initialized (first allocation from this heap).
+    if (heap->start == heap->end){
+        if (initHeap(heap) == -1) return NULL;
+    }
 
-        // Pointer given is valid, so free the block.
-        // Get pointers to adjacent blocks
-        sf_footer* prevBlockFooter = (void*)block - 8;
-        int mask = 0xFFFFFFFF;
-        mask = mask << 5;
-        size_t prevBlockSize = *prevBlockFooter & mask;
-        sf_block* prevBlock = (void*)block - prevBlockSize;
-        sf_block* nextBlock = (void*)block + getBlockSize(block);
-
-        int coalescedBlockIsWilderness = 0;
-
-        // If the adjacent blocks are in the heap, attempt to coalesce. If coalesced, remove the block from its free list.
-        if ((void*)prevBlock >= sf_mem_start() && (void*)prevBlock <= sf_mem_end()){
-            if (blockIsFree(prevBlock)){
-                if (isWildernessBlock(prevBlock)){
-                    coalescedBlockIsWilderness = 1;
-                    removeFromItsList(prevBlock, NUM_FREE_LISTS-1);
-                }
-                else{
-                    removeFromItsList(prevBlock, findFirstValidFreeList(getBlockSize(prevBlock)));
-                }
-                block = coalesceBlockWithBlock(block, prevBlock);
-            }
-        }
+    // Blocks freed by other threads are coalesced here, by the owner of the heap
+    drainRemoteFrees(heap);
 
-        if ((void*)nextBlock >= sf_mem_start() && (void*)nextBlock <= sf_mem_end()){
-            if (blockIsFree(nextBlock)){
-                if (isWildernessBlock(nextBlock)){
-                    coalescedBlockIsWilderness = 1;
-                    removeFromItsList(nextBlock, NUM_FREE_LISTS-1);
-                }
-                else{
-                    removeFromItsList(nextBlock, findFirstValidFreeList(getBlockSize(nextBlock)));
-                }
-                block = coalesceBlockWithBlock(block, nextBlock);
-            }
-        }
+    // A quick-listed block of the right size needs neither a search nor a split
+    sf_block* quickBlock = takeFromQuickList(heap, requiredBlockSize);
+    if (quickBlock != NULL) return quickBlock->body.payload;
 
-        // Then insert the block at the front of the appropriate free list, after coalescing w/ any adjacent free block
-        int appropriateFreeListIndex;
-        if (coalescedBlockIsWilderness){
-            appropriateFreeListIndex = NUM_FREE_LISTS-1;
-        }
-        else{
-            appropriateFreeListIndex = findFirstValidFreeList(getBlockSize(block));
-        }
+    // Look up the smallest segment of the free lists that can satisfy a request of specified size. If there is none, coalescing
+    //      the quick lists might make one.
+    sf_block* fittingBlock = findFreeBlock(heap, requiredBlockSize);
+    if (fittingBlock == NULL && heap->quickCount > 0){
+        coalesceQuickLists(heap);
+        fittingBlock = findFreeBlock(heap, requiredBlockSize);
+    }
+    if (fittingBlock != NULL){
+        return allocateFromFreeBlock(heap, fittingBlock, findFirstValidFreeList(getBlockSize(fittingBlock)), requiredBlockSize);
+    }
 
-        insertIntoList(block, appropriateFreeListIndex);
+    // Wilderness block must be used to satisfy request since the previous lists were all empty.
+    // If the wilderness block is not already large enough to satisfy the request, grow the heap until it is.
+    if (growWilderness(heap, requiredBlockSize) == -1) return NULL;
+    sf_block* wildernessFreeBlock = heap->freeListHeads[NUM_FREE_LISTS-1].body.links.next;
+    return allocateFromFreeBlock(heap, wildernessFreeBlock, NUM_FREE_LISTS-1, requiredBlockSize);
+}
 
-        // Blocks in a free list must not be marked as allocated (so change the allocation bit) and must have a valid footer w/ contents identical to header
-        block->header = getBlockSize(block);
-        sf_footer* footer = getFooterAddress(block);
-        *footer = block->header;
-        }
+// Cut as many blocks of requiredBlockSize as fit (but no more than count) from the start of a free block, which is removed from
+//      the freelist at the given index, and store their payloads in out. The remainder is handled as in
+//      allocateFromFreeBlock. Returns the number of blocks cut.
+size_t carveBlocks(sf_heap* heap, sf_block* block, int index, size_t requiredBlockSize, size_t count, void** out){
+    removeFromItsList(heap, block, index);
+    size_t blockSize = getBlockSize(block);
+    if (count > blockSize / requiredBlockSize) count = blockSize / requiredBlockSize;
+    size_t remainderSize = blockSize - count * requiredBlockSize;
+
+    // Every block but the first is preceded by another one of the batch. The last one absorbs a remainder too small to split.
+    sf_header prevAllocated = block->header & PREV_BLOCK_ALLOCATED;
+    for (size_t i=0; i<count; i++){
+        size_t size = requiredBlockSize;
+        if (i == count-1 && remainderSize < 32) size += remainderSize;
+        block->header = size | THIS_BLOCK_ALLOCATED | prevAllocated;
+        out[i] = block->body.payload;
+        prevAllocated = PREV_BLOCK_ALLOCATED;
+        block = getNextBlock(block);
+    }
 
-    return pp;
+    if (remainderSize < 32){
+        setPrevBlockAllocated(block, 1);
+        heap->splits += count - 1;
+    }
+    else{
+        block->header = remainderSize | PREV_BLOCK_ALLOCATED;
+        *getFooterAddress(block) = block->header;
+        if (index == NUM_FREE_LISTS-1) insertIntoList(heap, block, NUM_FREE_LISTS-1);
+        else insertIntoList(heap, block, findFirstValidFreeList(remainderSize));
+        heap->splits += count;
+    }
+    updatePeakInUse(heap);
+    if (index == NUM_FREE_LISTS-1) markDirty(heap, (void*)block + 32);
+    return count;
 }
 
-/*
+// Body of sf_malloc_batch, called w/ the heap's lock held. Each pass takes the best free block that holds every block still
+//      needed, or else the wilderness block grown to hold them, and cuts them all from it. Only when the heap cannot hold
+//      them all in one piece are they cut from several free blocks. Returns the number of blocks allocated.
+size_t heapMallocBatch(sf_heap* heap, size_t requiredBlockSize, size_t count, void** out){
+    if (heap->start == heap->end){
+        if (initHeap(heap) == -1) return 0;
+    }
+    drainRemoteFrees(heap);
+
+    sf_block* wildernessSentinel = &heap->freeListHeads[NUM_FREE_LISTS-1];
+    size_t done = 0;
+    while (done < count){
+        size_t wanted = count - done;
+        size_t wantedSize = (wanted > SIZE_MAX / requiredBlockSize) ? SIZE_MAX & ~(size_t)31 : wanted * requiredBlockSize;
+
+        sf_block* block = findFreeBlock(heap, wantedSize);
+        if (block == NULL && growWilderness(heap, wantedSize) == 0) block = wildernessSentinel->body.links.next;
+        if (block == NULL) block = findFreeBlock(heap, requiredBlockSize);
+        if (block == NULL && heap->quickCount > 0){
+            coalesceQuickLists(heap);
+            block = findFreeBlock(heap, requiredBlockSize);
+        }
+        if (block == NULL && growWilderness(heap, requiredBlockSize) == 0) block = wildernessSentinel->body.links.next;
+        if (block == NULL) break;
+
+        int index = isWildernessBlock(heap, block) ? NUM_FREE_LISTS-1 : findFirstValidFreeList(getBlockSize(block));
+        done += carveBlocks(heap, block, index, requiredBlockSize, wanted, out + done);
+    }
+    return done;
+}
+
+// Body of sf_memalign, called w/ the heap's lock held. Allocates a block large enough to contain a block of requiredBlockSize
+//      whose payload is aligned to align, then frees the part before the aligned block and the part after it, so that no
+//      padding is left behind. Returns NULL if no memory is available.
+void* heapMemalign(sf_heap* heap, size_t requiredBlockSize, size_t align){
+    // Payloads are already 32-byte aligned, so the aligned payload is at most align-32 bytes in, and any non-empty part before
+    //      it is large enough to be a free block
+    if (requiredBlockSize > SIZE_MAX - align) return NULL;
+    void* pp = heapMalloc(heap, requiredBlockSize + align - 32);
+    if (pp == NULL) return NULL;
+    sf_block* block = (sf_block*)(pp - sizeof(sf_header));
+
+    size_t leadingSize = (align - (uintptr_t)pp % align) % align;
+    if (leadingSize > 0){
+        sf_block* alignedBlock = (void*)block + leadingSize;
+        alignedBlock->header = (getBlockSize(block) - leadingSize) | THIS_BLOCK_ALLOCATED;
+        block->header = leadingSize | THIS_BLOCK_ALLOCATED | (block->header & PREV_BLOCK_ALLOCATED);
+        heap->splits++;
+        freeBlock(heap, block);
+        block = alignedBlock;
+    }
+
+    if (!splitWillSplinter(block, requiredBlockSize)){
+        heap->splits++;
+        freeBlock(heap, splitBlock(block, requiredBlockSize));
+    }
+    return block->body.payload;
+}
+
+// Grow an allocated block in place to requiredBlockSize by absorbing the free block after it. If that is the wilderness block
+//      (or the epilogue), the heap is grown first if needed. Called w/ the heap's lock held. Returns 1 on success, 0 if the
+//      block cannot grow in place.
+int growBlockInPlace(sf_heap* heap, sf_block* block, size_t requiredBlockSize){
+    size_t blockSize = getBlockSize(block);
+    sf_block* nextBlock = getNextBlock(block);
+    int nextIsWilderness = ((void*)nextBlock == heap->end - 8 || (blockIsFree(nextBlock) && isWildernessBlock(heap, nextBlock)));
+
+    if (nextIsWilderness){
+        if (growWilderness(heap, requiredBlockSize - blockSize) == -1) return 0;
+        nextBlock = getNextBlock(block);
+    }
+    else if (!blockIsFree(nextBlock) || blockSize + getBlockSize(nextBlock) < requiredBlockSize){
+        return 0;
+    }
+
+    // Absorb the next block, then give back what is not needed, unless that would leave a splinter
+    int index = nextIsWilderness ? NUM_FREE_LISTS-1 : findFirstValidFreeList(getBlockSize(nextBlock));
+    removeFromItsList(heap, nextBlock, index);
+    block->header = (blockSize + getBlockSize(nextBlock)) | THIS_BLOCK_ALLOCATED | (block->header & PREV_BLOCK_ALLOCATED);
+
+    if (splitWillSplinter(block, requiredBlockSize)){
+        setPrevBlockAllocated(getNextBlock(block), 1);
+    }
+    else{
+        sf_block* remainderBlock = splitBlock(block, requiredBlockSize);
+        heap->splits++;
+        if (nextIsWilderness) insertIntoList(heap, remainderBlock, NUM_FREE_LISTS-1);
+        else insertIntoList(heap, remainderBlock, findFirstValidFreeList(getBlockSize(remainderBlock)));
+    }
+    updatePeakInUse(heap);
+    if (nextIsWilderness) markDirty(heap, (void*)getNextBlock(block) + 32);
+    return 1;
+}
+
+// -------------------------------------------------------------------------------------------------------------------------
+
+
+
+// Huge blocks -------------------------------------------------------------------------------------------------------------
+// Requests of at least mmapThreshold bytes get a mapping of their own instead of a block in a heap, so that freeing them gives
+//      the memory straight back to the OS. The payload of a mapped block is offset bytes into its mapping: 32 for sf_malloc,
+//      or the alignment asked of sf_memalign, up to a page. The block's header is right before the payload, and the word
+//      before that holds MAPPED_BLOCK_MAGIC ^ the address of the mapping. The header of the block has MAPPED_BLOCK set, and
+//      its size covers the rest of the mapping except for the last 8 bytes, so the mapping is offset + the block size long.
+// The payload of every mapped block is also in a hash set, which sf_free looks a pointer up in before it reads anything
+//      around it, so that a bad pointer outside of the heaps aborts instead of faulting. The set lives in memory mapped for
+//      it, like the heap profiler's table.
+#define MAPPING_ALIGN 4096                          // Mappings are page-aligned and a whole number of pages long
+#define MAPPED_BLOCK_MAGIC ((uintptr_t)0x73666d6d61707065)
+#define MAPPED_REMOVED ((void*)1)                   // Marks a slot whose payload was removed, so that probing goes past it
+
+static size_t mmapThreshold = 0;                    // 0 disables mapped blocks. Set by sf_mallopt
+static size_t mappedBlocks = 0;                     // Number of mapped blocks (see sf_get_stats)
+static size_t mappedBytes = 0;                      // Total size of their mappings
+static size_t peakMappedBytes = 0;
+static pthread_mutex_t mappedLock = PTHREAD_MUTEX_INITIALIZER;
+static void** mappedPayloads = NULL;                // Open-addressing hash set of mappedCapacity slots (a power of two)
+static size_t mappedCapacity = 0;
+static size_t mappedCount = 0;                      // Payloads in the set
+static size_t mappedSlotsUsed = 0;                  // Payloads in the set and removed ones
+
+// Keep count of the mapped blocks and of the size of their mappings, as a mapping of the given size is made (blocks 1) or
+//      undone (blocks -1), or grows or shrinks by size (blocks 0)
+void countMapping(int blocks, size_t size){
+    __atomic_add_fetch(&mappedBlocks, blocks, __ATOMIC_RELAXED);
+    size_t total = __atomic_add_fetch(&mappedBytes, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peakMappedBytes, __ATOMIC_RELAXED);
+    while (total > peak && !__atomic_compare_exchange_n(&peakMappedBytes, &peak, total, 1, __ATOMIC_RELAXED,
+                                                         __ATOMIC_RELAXED));
+}
+
+// Return the slot of the hash set of the given capacity where probing for a payload starts
+size_t getMappedSlot(void* pp, size_t capacity){
+    uint64_t key = (uintptr_t)pp >> 5;
+    return (key * 0x9e3779b97f4a7c15ULL >> 32) & (capacity - 1);
+}
+
+// Make room in the hash set for one more payload, rebuilding it twice as large (w/o the removed slots) when it is 3/4 full.
+//      Called w/ mappedLock held. Returns -1 if no memory is available.
+int reserveMappedSlot(){
+    if ((mappedSlotsUsed + 1) * 4 <= mappedCapacity * 3) return 0;
+    size_t capacity = (mappedCapacity == 0) ? 512 : (mappedCount + 1) * 4 > mappedCapacity ? 2 * mappedCapacity : mappedCapacity;
+    void** table = mmap(NULL, capacity * sizeof(void*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) return -1;
+    for (size_t i=0; i<mappedCapacity; i++){
+        if (mappedPayloads[i] == NULL || mappedPayloads[i] == MAPPED_REMOVED) continue;
+        size_t slot = getMappedSlot(mappedPayloads[i], capacity);
+        while (table[slot] != NULL) slot = (slot + 1) & (capacity - 1);
+        table[slot] = mappedPayloads[i];
+    }
+    if (mappedPayloads != NULL) munmap(mappedPayloads, mappedCapacity * sizeof(void*));
+    mappedPayloads = table;
+    mappedCapacity = capacity;
+    mappedSlotsUsed = mappedCount;
+    return 0;
+}
+
+// Return the slot holding a payload, or the empty slot where probing for it stopped. Called w/ mappedLock held, once the set
+//      exists.
+size_t findMappedSlot(void* pp){
+    size_t slot = getMappedSlot(pp, mappedCapacity);
+    while (mappedPayloads[slot] != NULL && mappedPayloads[slot] != pp) slot = (slot + 1) & (mappedCapacity - 1);
+    return slot;
+}
+
+// Add a payload to the hash set, which must have room for it (see reserveMappedSlot). Called w/ mappedLock held.
+void insertMappedPayload(void* pp){
+    size_t slot = getMappedSlot(pp, mappedCapacity);
+    while (mappedPayloads[slot] != NULL && mappedPayloads[slot] != MAPPED_REMOVED) slot = (slot + 1) & (mappedCapacity - 1);
+    if (mappedPayloads[slot] == NULL) mappedSlotsUsed++;
+    mappedPayloads[slot] = pp;
+    __atomic_store_n(&mappedCount, mappedCount + 1, __ATOMIC_RELEASE);
+}
+
+// Remove a payload from the hash set. Called w/ mappedLock held.
+void removeMappedPayload(void* pp){
+    size_t slot = findMappedSlot(pp);
+    if (mappedPayloads[slot] != pp) return;
+    mappedPayloads[slot] = MAPPED_REMOVED;
+    __atomic_store_n(&mappedCount, mappedCount - 1, __ATOMIC_RELEASE);
+}
+
+// Given a required block size and the offset of the payload, return the size of the mapping needed, or 0 if it is too large
+size_t getMappingSize(size_t requiredBlockSize, size_t offset){
+    if (requiredBlockSize > SIZE_MAX - offset - MAPPING_ALIGN) return 0;
+    return (requiredBlockSize + offset + MAPPING_ALIGN - 1) & ~(size_t)(MAPPING_ALIGN - 1);
+}
+
+// Return the mapping of a mapped block, and the offset of its payload in it
+void* getMapping(sf_block* block){
+    return (void*)(*(uintptr_t*)((void*)block - 8) ^ MAPPED_BLOCK_MAGIC);
+}
+
+size_t getMappingOffset(sf_block* block){
+    return (void*)block->body.payload - getMapping(block);
+}
+
+// Write the magic word and the header of the block of a new (or moved) mapping, and return the block
+sf_block* initMappedBlock(void* mapping, size_t mappingSize, size_t offset){
+    sf_block* block = mapping + offset - sizeof(sf_header);
+    *(uintptr_t*)((void*)block - 8) = MAPPED_BLOCK_MAGIC ^ (uintptr_t)mapping;
+    block->header = (mappingSize - offset) | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED | MAPPED_BLOCK;
+    return block;
+}
+
+// Map a block of at least requiredBlockSize bytes whose payload is aligned to align, a power of two of at least 32. An
+//      alignment beyond a page is reached by mapping align - MAPPING_ALIGN more bytes, and unmapping them again on either
+//      side of the aligned mapping. Returns NULL if the mapping fails.
+sf_block* mapBlock(size_t requiredBlockSize, size_t align){
+    size_t offset = (align < MAPPING_ALIGN) ? align : MAPPING_ALIGN;
+    size_t mappingSize = getMappingSize(requiredBlockSize, offset);
+    size_t slack = (align > MAPPING_ALIGN) ? align - MAPPING_ALIGN : 0;
+    if (mappingSize == 0 || mappingSize > SIZE_MAX - slack) return NULL;
+    void* region = mmap(NULL, mappingSize + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) return NULL;
+    void* mapping = region;
+    if (slack > 0){
+        mapping = (void*)(((uintptr_t)region + offset + align - 1) & ~(uintptr_t)(align - 1)) - offset;
+        if (mapping > region) munmap(region, mapping - region);
+        if (mapping + mappingSize < region + mappingSize + slack){
+            munmap(mapping + mappingSize, region + slack - mapping);
+        }
+    }
+
+    pthread_mutex_lock(&mappedLock);
+    int reserved = reserveMappedSlot();
+    if (reserved == 0) insertMappedPayload(mapping + offset);
+    pthread_mutex_unlock(&mappedLock);
+    if (reserved == -1){
+        munmap(mapping, mappingSize);
+        return NULL;
+    }
+    countMapping(1, mappingSize);
+    return initMappedBlock(mapping, mappingSize, offset);
+}
+
+// Resize the mapping of a mapped block to hold at least requiredBlockSize bytes. The kernel moves the pages if it has to, so
+//      the payload is never copied. Returns the (possibly moved) block, or NULL if the mapping could not be resized.
+sf_block* remapBlock(sf_block* block, size_t requiredBlockSize){
+    void* mapping = getMapping(block);
+    size_t offset = getMappingOffset(block);
+    size_t mappingSize = getMappingSize(requiredBlockSize, offset);
+    if (mappingSize == 0) return NULL;
+    size_t oldMappingSize = getBlockSize(block) + offset;
+    if (mappingSize == oldMappingSize) return block;
+
+    // The lock is held across mremap, so that the set never misses a payload that exists
+    pthread_mutex_lock(&mappedLock);
+    void* newMapping = (reserveMappedSlot() == 0) ? mremap(mapping, oldMappingSize, mappingSize, MREMAP_MAYMOVE) : MAP_FAILED;
+    if (newMapping != MAP_FAILED && newMapping != mapping){
+        removeMappedPayload(mapping + offset);
+        insertMappedPayload(newMapping + offset);
+    }
+    pthread_mutex_unlock(&mappedLock);
+    if (newMapping == MAP_FAILED) return NULL;
+    countMapping(0, mappingSize - oldMappingSize);
+    return initMappedBlock(newMapping, mappingSize, offset);
+}
+
+// Give the mapping of a mapped block back to the OS
+void unmapBlock(sf_block* block){
+    void* mapping = getMapping(block);
+    size_t mappingSize = getBlockSize(block) + getMappingOffset(block);
+    pthread_mutex_lock(&mappedLock);
+    removeMappedPayload(block->body.payload);
+    pthread_mutex_unlock(&mappedLock);
+    *(uintptr_t*)((void*)block - 8) = 0;
+    countMapping(-1, -mappingSize);
+    munmap(mapping, mappingSize);
+}
+
+// Return 1 if the given pointer is the payload of a mapped block. 0, otherwise.
+// Only the payload of a live mapped block is ever dereferenced. While there is none, nothing is locked either.
+int mappedPointerIsValid(void* p){
+    if (p == NULL || (uintptr_t)p % 32 != 0) return 0;
+    if (__atomic_load_n(&mappedCount, __ATOMIC_ACQUIRE) == 0 || heapOf(p) != NULL) return 0;
+
+    pthread_mutex_lock(&mappedLock);
+    int registered = mappedCapacity > 0 && mappedPayloads[findMappedSlot(p)] == p;
+    pthread_mutex_unlock(&mappedLock);
+    if (!registered) return 0;
+
+    sf_block* block = p - sizeof(sf_header);
+    uintptr_t mapping = (uintptr_t)getMapping(block);
+    if (mapping % MAPPING_ALIGN != 0 || (uintptr_t)p - mapping < 32 || (uintptr_t)p - mapping > MAPPING_ALIGN) return 0;
+    if (!(block->header & MAPPED_BLOCK) || blockIsFree(block)) return 0;
+    if ((getBlockSize(block) + getMappingOffset(block)) % MAPPING_ALIGN != 0) return 0;
+    return 1;
+}
+
+void* mallocBlock(size_t size);                     // The body of sf_malloc, below
+
+// Resize a mapped block. Requests that are still huge are resized in place by remapping. Smaller ones move into a heap
+//      (or stay mapped, if the heap has no room). Sets sf_errno to ENOMEM and returns NULL if neither is possible.
+void* reallocMappedBlock(sf_block* block, size_t rsize){
+    size_t requiredBlockSize = getRequiredBlockSize(rsize);
+    size_t threshold = __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED);
+
+    if (threshold == 0 || rsize < threshold){
+        void* pp = mallocBlock(rsize);
+        if (pp != NULL){
+            size_t oldPayloadSize = getBlockSize(block) - sizeof(sf_header);
+            memcpy(pp, block->body.payload, (rsize < oldPayloadSize) ? rsize : oldPayloadSize);
+            unmapBlock(block);
+            return pp;
+        }
+    }
+
+    sf_block* newBlock = remapBlock(block, requiredBlockSize);
+    if (newBlock == NULL){
+        setErrno(ENOMEM);
+        return NULL;
+    }
+    return newBlock->body.payload;
+}
+
+// -------------------------------------------------------------------------------------------------------------------------
+
+
+
+// Thread cache ------------------------------------------------------------------------------------------------------------
+// Each thread keeps a small cache of recently freed blocks for every block size from 32 up to TCACHE_MAX_BLOCK_SIZE bytes.
+// A cached block stays marked as allocated, so it is never coalesced, and is kept in a singly linked list through
+//      body.links.next. sf_malloc and sf_free serve these sizes w/o taking a lock or touching the free lists.
+// When a bin overflows, its least recently freed half is flushed back to the free lists of the heaps that own the blocks.
+#define TCACHE_MAX_BLOCK_SIZE 1024
+#define TCACHE_BINS (TCACHE_MAX_BLOCK_SIZE / 32)
+#define TCACHE_KEY ((sf_block*)&tcacheKey)         // Stored in body.links.prev of cached blocks to catch double frees
+
+typedef struct sf_tcache {
+    sf_block* bins[TCACHE_BINS];                    // Bin i holds blocks of size 32 * (i+1)
+    int counts[TCACHE_BINS];
+    int registered;                                 // 1 once the cache will be flushed when the thread exits, -1 once it was
+} sf_tcache;
+
+static int tcacheCount = 0;                         // Blocks kept per bin, 0 disables the cache. Set by sf_mallopt
+static pthread_key_t tcacheKey;
+static pthread_once_t tcacheKeyOnce = PTHREAD_ONCE_INIT;
+static __thread sf_tcache threadCache;
+
+// Give every block in a bin after the first "keep" blocks back to the heaps that own them. Blocks of the calling thread's
+//      heap are freed under its lock, taken once. Blocks of other heaps go onto their remote-free queues.
+int flushThreadCacheBin(int bin, int keep){
+    sf_block** link = &threadCache.bins[bin];
+    for (int i=0; i<keep && *link != NULL; i++){
+        link = &(*link)->body.links.next;
+    }
+    sf_block* block = *link;
+    *link = NULL;
+    int flushed = threadCache.counts[bin] - keep;
+    threadCache.counts[bin] = keep;
+
+    sf_heap* ownHeap = getThreadHeap();
+    int locked = 0;
+    while (block != NULL){
+        sf_block* next = block->body.links.next;
+        sf_heap* heap = heapOf(block);
+        if (heap != ownHeap){
+            pushRemoteFree(heap, block);
+        }
+        else{
+            if (!locked){
+                pthread_mutex_lock(&ownHeap->lock);
+                locked = 1;
+            }
+            releaseBlock(ownHeap, block);
+        }
+        block = next;
+    }
+    if (locked) pthread_mutex_unlock(&ownHeap->lock);
+    return flushed;
+}
+
+// Empty the calling thread's cache. Returns the number of blocks given back.
+int flushThreadCache(){
+    int flushed = 0;
+    for (int bin=0; bin<TCACHE_BINS; bin++){
+        if (threadCache.counts[bin] > 0) flushed += flushThreadCacheBin(bin, 0);
+    }
+    return flushed;
+}
+
+// Destructor of tcacheKey, so that the blocks cached by a thread are not lost when it exits. Other destructors may still free
+//      blocks on this thread after it, and the key would not run again, so the cache is closed for good.
+void flushThreadCacheOnExit(void* cache){
+    threadCache.registered = -1;
+    flushThreadCache();
+}
+
+void createThreadCacheKey(){
+    pthread_key_create(&tcacheKey, flushThreadCacheOnExit);
+}
+
+// Take a block of exactly blockSize bytes from the calling thread's cache. NULL if there is none.
+sf_block* takeFromThreadCache(size_t blockSize){
+    int bin = blockSize / 32 - 1;
+    sf_block* block = threadCache.bins[bin];
+    if (block != NULL){
+        threadCache.bins[bin] = block->body.links.next;
+        threadCache.counts[bin]--;
+        block->body.links.prev = NULL;
+    }
+    return block;
+}
+
+// Put an allocated block into the calling thread's cache, flushing half of its bin if the bin overflows.
+void putInThreadCache(sf_block* block, int maxCount){
+    int bin = getBlockSize(block) / 32 - 1;
+
+    // A block that carries the key might already be in the cache. Freeing it again would corrupt the bin.
+    if (block->body.links.prev == TCACHE_KEY){
+        for (sf_block* cached = threadCache.bins[bin]; cached != NULL; cached = cached->body.links.next){
+            if (cached == block) abort();
+        }
+    }
+    if (!threadCache.registered){
+        threadCache.registered = 1;
+        pthread_once(&tcacheKeyOnce, createThreadCacheKey);
+        pthread_setspecific(tcacheKey, &threadCache);
+    }
+
+    block->body.links.next = threadCache.bins[bin];
+    block->body.links.prev = TCACHE_KEY;
+    threadCache.bins[bin] = block;
+    if (++threadCache.counts[bin] > maxCount){
+        flushThreadCacheBin(bin, maxCount / 2);
+    }
+}
+
+// Free a valid allocated block of a heap: into the thread cache if it has room, else back into the heap that owns it.
+// Blocks of another heap are handed to that heap, which coalesces them on its next allocation.
+void freeHeapBlock(sf_block* block){
+    // Small blocks go into the thread cache while it has room
+    int maxCount = __atomic_load_n(&tcacheCount, __ATOMIC_RELAXED);
+    if (maxCount > 0 && getBlockSize(block) <= TCACHE_MAX_BLOCK_SIZE && threadCache.registered != -1){
+        putInThreadCache(block, maxCount);
+        return;
+    }
+
+    sf_heap* heap = heapOf(block);
+    if (heap != getThreadHeap()){
+        pushRemoteFree(heap, block);
+        return;
+    }
+    pthread_mutex_lock(&heap->lock);
+    releaseBlock(heap, block);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+// -------------------------------------------------------------------------------------------------------------------------
+
+
+
+// Statistics --------------------------------------------------------------------------------------------------------------
+// Most counters belong to a heap, and are kept under its lock. The calls to the public functions are counted by each thread
+//      for itself instead, as the thread cache serves many of them w/o a lock. The counters of every thread are in a list,
+//      so that sf_get_stats can add them up, and are added to the sentinel of the list when the thread exits.
+typedef struct sf_thread_stats {
+    size_t mallocs;
+    size_t frees;
+    size_t reallocs;
+    int registered;                                 // 1 once the counters are in the list
+    struct sf_thread_stats* next;
+    struct sf_thread_stats* prev;
+} sf_thread_stats;
+
+static __thread sf_thread_stats threadStats;
+static sf_thread_stats threadStatsList = {0, 0, 0, 1, &threadStatsList, &threadStatsList};
+static pthread_mutex_t threadStatsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t threadStatsKey;
+static pthread_once_t threadStatsKeyOnce = PTHREAD_ONCE_INIT;
+
+// Destructor of threadStatsKey, so that the calls counted by a thread still count after it exits
+void retireThreadStats(void* stats){
+    pthread_mutex_lock(&threadStatsLock);
+    threadStatsList.mallocs += threadStats.mallocs;
+    threadStatsList.frees += threadStats.frees;
+    threadStatsList.reallocs += threadStats.reallocs;
+    threadStats.prev->next = threadStats.next;
+    threadStats.next->prev = threadStats.prev;
+    pthread_mutex_unlock(&threadStatsLock);
+    memset(&threadStats, 0, sizeof(threadStats));
+}
+
+void createThreadStatsKey(){
+    pthread_key_create(&threadStatsKey, retireThreadStats);
+}
+
+// Put the calling thread's counters in the list
+void registerThreadStats(){
+    // pthread_setspecific may allocate, which must not come back here
+    threadStats.registered = 1;
+    pthread_once(&threadStatsKeyOnce, createThreadStatsKey);
+    pthread_setspecific(threadStatsKey, &threadStats);
+    pthread_mutex_lock(&threadStatsLock);
+    threadStats.next = threadStatsList.next;
+    threadStats.prev = &threadStatsList;
+    threadStatsList.next->prev = &threadStats;
+    threadStatsList.next = &threadStats;
+    pthread_mutex_unlock(&threadStatsLock);
+}
+
+// Add n to one of the calling thread's counters. Only the thread itself writes them, so this needs no atomic read-modify-write,
+//      but the store is atomic so that sf_get_stats can read them at any time.
+void countCalls(size_t* counter, size_t n){
+    if (!threadStats.registered) registerThreadStats();
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+// Return the size of the largest free block of a heap. Called w/ the heap's lock held.
+size_t getLargestFreeBlock(sf_heap* heap){
+    size_t largest = heap->freeBytes[NUM_FREE_LISTS-1];
+    size_t largestListed = 0;
+
+    // The treap is ordered by size, and holds blocks larger than any in a segment. Every segment holds blocks of one size.
+    if (heap->treeRoot != NULL){
+        sf_block* block = heap->treeRoot;
+        while (getTreeLinks(block)->right != NULL){
+            block = getTreeLinks(block)->right;
+        }
+        largestListed = getBlockSize(block);
+    }
+    else if (heap->flBitmap != 0){
+        int fl = 63 - __builtin_clzl(heap->flBitmap);
+        int sl = 31 - __builtin_clz(heap->slBitmap[fl]);
+        largestListed = getBlockSize(heap->segmentHeads[fl][sl]);
+    }
+    return (largestListed > largest) ? largestListed : largest;
+}
+
+// -------------------------------------------------------------------------------------------------------------------------
+
+
+
+// Heap profiler -----------------------------------------------------------------------------------------------------------
+// Each thread counts down the bytes it allocates to its next sample. The gaps are exponentially distributed w/ a mean of
+//      sampleRate bytes, like tcmalloc's, so that a sample stands for sampleRate bytes whatever the sizes allocated. A sampled
+//      block gets SAMPLED_BLOCK in its header, and the stack trace of its allocation goes into a hash table keyed by its
+//      payload address, where freeing it finds and removes it. The table lives in memory mapped for it, so the profiler
+//      never allocates from the heaps it profiles.
+#define SAMPLE_MAX_FRAMES 32
+#define SAMPLE_REMOVED ((void*)1)                   // Marks a slot whose sample was removed, so that probing goes past it
+
+typedef struct sf_sample {
+    void* pp;                                       // Payload of the sampled block, NULL for an empty slot
+    size_t size;                                    // Size requested for the block
+    int depth;
+    void* stack[SAMPLE_MAX_FRAMES];
+} sf_sample;
+
+typedef struct sf_sampler {
+    long long bytesLeft;                            // Bytes to allocate before the next sample
+    size_t rate;                                    // Rate bytesLeft was drawn for, 0 until the thread's first allocation
+    uint64_t random;                                // xorshift state
+    int busy;                                       // 1 while taking a sample, as backtrace may allocate
+} sf_sampler;
+
+static size_t sampleRate = 0;                       // Mean bytes between samples, 0 disables the profiler. Set by sf_mallopt
+static __thread sf_sampler threadSampler;
+static pthread_mutex_t samplesLock = PTHREAD_MUTEX_INITIALIZER;
+static sf_sample* samples = NULL;                   // Open-addressing hash table of sampleCapacity slots (a power of two)
+static size_t sampleCapacity = 0;
+static size_t sampleCount = 0;                      // Live samples
+static size_t sampleSlotsUsed = 0;                  // Live samples and removed ones
+
+// Return the number of bytes to allocate before the next sample: exponentially distributed w/ a mean of rate
+long long getSampleGap(sf_sampler* sampler, size_t rate){
+    sampler->random ^= sampler->random << 13;
+    sampler->random ^= sampler->random >> 7;
+    sampler->random ^= sampler->random << 17;
+    double uniform = ((sampler->random >> 11) + 1) * (1.0 / 9007199254740992.0);     // In (0, 1]
+    double gap = -log(uniform) * rate;
+    return (gap < 1e15) ? (long long)gap + 1 : (long long)1e15;
+}
+
+// Return the slot of the hash table of the given capacity where probing for a payload address starts
+size_t getSampleSlot(void* pp, size_t capacity){
+    uint64_t key = (uintptr_t)pp >> 5;
+    return (key * 0x9e3779b97f4a7c15ULL >> 32) & (capacity - 1);
+}
+
+// Make room in the hash table for one more sample, rebuilding it twice as large (w/o the removed slots) when it is 3/4 full.
+//      Called w/ samplesLock held. Returns -1 if no memory is available.
+int reserveSampleSlot(){
+    if ((sampleSlotsUsed + 1) * 4 <= sampleCapacity * 3) return 0;
+    size_t capacity = (sampleCapacity == 0) ? 1024 : (sampleCount + 1) * 4 > sampleCapacity ? 2 * sampleCapacity : sampleCapacity;
+    sf_sample* table = mmap(NULL, capacity * sizeof(sf_sample), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) return -1;
+    for (size_t i=0; i<sampleCapacity; i++){
+        if (samples[i].pp == NULL || samples[i].pp == SAMPLE_REMOVED) continue;
+        size_t slot = getSampleSlot(samples[i].pp, capacity);
+        while (table[slot].pp != NULL) slot = (slot + 1) & (capacity - 1);
+        table[slot] = samples[i];
+    }
+    if (samples != NULL) munmap(samples, sampleCapacity * sizeof(sf_sample));
+    samples = table;
+    sampleCapacity = capacity;
+    sampleSlotsUsed = sampleCount;
+    return 0;
+}
+
+// Set or clear SAMPLED_BLOCK in the header of an allocated block. This is done under the lock of the block's heap, as freeing,
+//      splitting or coalescing the block before it in memory also rewrites that header (see setPrevBlockAllocated), from
+//      whichever thread does it. A mapped block has no heap and no neighbors.
+void setSampled(sf_block* block, int sampled){
+    sf_heap* heap = heapOf(block);
+    if (heap != NULL) pthread_mutex_lock(&heap->lock);
+    sf_header header = readHeader(block);
+    header = sampled ? (header | SAMPLED_BLOCK) : (header & ~(sf_header)SAMPLED_BLOCK);
+    __atomic_store_n(&block->header, header, __ATOMIC_RELAXED);
+    if (heap != NULL) pthread_mutex_unlock(&heap->lock);
+}
+
+// Count an allocation of size bytes at pp towards the calling thread's next sample, and sample it if it is due
+void profileAllocation(void* pp, size_t size, size_t rate){
+    sf_sampler* sampler = &threadSampler;
+    if (sampler->busy) return;
+    if (sampler->rate != rate){
+        if (sampler->random == 0) sampler->random = ((uintptr_t)sampler * 0x9e3779b97f4a7c15ULL) | 1;
+        sampler->rate = rate;
+        sampler->bytesLeft = getSampleGap(sampler, rate);
+    }
+    sampler->bytesLeft -= (size < (size_t)1 << 62) ? (long long)size : (long long)1 << 62;
+    if (sampler->bytesLeft > 0) return;
+    sampler->bytesLeft = getSampleGap(sampler, rate);
+
+    sampler->busy = 1;
+    void* stack[SAMPLE_MAX_FRAMES + 1];
+    int depth = backtrace(stack, SAMPLE_MAX_FRAMES + 1) - 1;     // Leave out this function
+
+    int sampled = 0;
+    pthread_mutex_lock(&samplesLock);
+    if (depth > 0 && reserveSampleSlot() == 0){
+        size_t slot = getSampleSlot(pp, sampleCapacity);
+        while (samples[slot].pp != NULL && samples[slot].pp != SAMPLE_REMOVED) slot = (slot + 1) & (sampleCapacity - 1);
+        if (samples[slot].pp == NULL) sampleSlotsUsed++;
+        samples[slot].pp = pp;
+        samples[slot].size = size;
+        samples[slot].depth = depth;
+        memcpy(samples[slot].stack, stack + 1, depth * sizeof(void*));
+        sampleCount++;
+        sampled = 1;
+    }
+    pthread_mutex_unlock(&samplesLock);
+    if (sampled) setSampled(pp - sizeof(sf_header), 1);
+    sampler->busy = 0;
+}
+
+// Return the payload of a successful allocation of size bytes, after counting it towards a sample if the profiler is on
+void* profiled(void* pp, size_t size){
+    size_t rate = __atomic_load_n(&sampleRate, __ATOMIC_RELAXED);
+    if (rate > 0 && pp != NULL) profileAllocation(pp, size, rate);
+    return pp;
+}
+
+// Remove the sample of a sampled block, which is about to be freed or resized
+void removeSample(sf_block* block){
+    void* pp = block->body.payload;
+    setSampled(block, 0);
+    pthread_mutex_lock(&samplesLock);
+    size_t slot = getSampleSlot(pp, sampleCapacity);
+    while (samples[slot].pp != NULL){
+        if (samples[slot].pp == pp){
+            samples[slot].pp = SAMPLE_REMOVED;
+            sampleCount--;
+            break;
+        }
+        slot = (slot + 1) & (sampleCapacity - 1);
+    }
+    pthread_mutex_unlock(&samplesLock);
+}
+
+// Write a whole string to a file descriptor. Returns 0 on success, -1 on error.
+int writeString(int fd, const char* string, size_t length){
+    while (length > 0){
+        ssize_t written = write(fd, string, length);
+        if (written == -1 && errno == EINTR) continue;
+        if (written <= 0) return -1;
+        string += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// -------------------------------------------------------------------------------------------------------------------------
+
+
+
+// Heap maps ---------------------------------------------------------------------------------------------------------------
+// sf_heap_map_dump writes its records through a buffer on the stack, as a heap may have millions of blocks
+typedef struct sf_map_writer {
+    int fd;
+    int failed;                                     // -1 once a write failed, after which nothing more is written
+    size_t length;                                  // Bytes in buffer
+    char buffer[4096];
+} sf_map_writer;
+
+// Write out the buffered records
+void flushMap(sf_map_writer* writer){
+    if (writer->failed == 0 && writer->length > 0) writer->failed = writeString(writer->fd, writer->buffer, writer->length);
+    writer->length = 0;
+}
+
+// Add a record of at most 128 bytes to the buffer
+void writeMap(sf_map_writer* writer, const void* record, size_t length){
+    if (writer->length + length > sizeof(writer->buffer)) flushMap(writer);
+    memcpy(writer->buffer + writer->length, record, length);
+    writer->length += length;
+}
+
+// Return the index of the free list holding a block, or -1 if the block is allocated. Called w/ the heap's lock held.
+int getFreeListIndex(sf_heap* heap, sf_block* block){
+    if (!blockIsFree(block)) return -1;
+    if (isWildernessBlock(heap, block)) return NUM_FREE_LISTS-1;
+    return findFirstValidFreeList(getBlockSize(block));
+}
+
+// Return the first block of a heap (the one after the prologue). The last one ends at the epilogue, at heap->end - 8.
+sf_block* getFirstBlock(sf_heap* heap){
+    return heap->start + 24 + 32;
+}
+
+// Write the map of one heap. Called w/ the heap's lock held.
+void writeHeapMap(sf_map_writer* writer, sf_heap* heap, int index, int format){
+    size_t blocks = 0;
+    if (heap->start != heap->end){
+        for (sf_block* block = getFirstBlock(heap); (void*)block < heap->end - 8; block = getNextBlock(block)) blocks++;
+    }
+
+    char record[128];
+    if (format == SF_HEAP_MAP_BINARY){
+        struct sf_heap_map_heap heapRecord = {heap->end - heap->start, blocks};
+        writeMap(writer, &heapRecord, sizeof(heapRecord));
+    }
+    else{
+        int length = snprintf(record, sizeof(record), "%s{\"heap\": %d, \"size\": %zu, \"blocks\": [", (index > 0) ? ",\n" : "",
+                              index, (size_t)(heap->end - heap->start));
+        writeMap(writer, record, length);
+    }
+    if (blocks == 0){
+        if (format == SF_HEAP_MAP_JSON) writeMap(writer, "]}", 2);
+        return;
+    }
+
+    for (sf_block* block = getFirstBlock(heap); (void*)block < heap->end - 8; block = getNextBlock(block)){
+        size_t offset = (void*)block - heap->start;
+        int list = getFreeListIndex(heap, block);
+        if (format == SF_HEAP_MAP_BINARY){
+            struct sf_heap_map_block blockRecord = {offset, getBlockSize(block), list == -1, list, 0};
+            writeMap(writer, &blockRecord, sizeof(blockRecord));
+        }
+        else{
+            int length = snprintf(record, sizeof(record), "%s[%zu, %zu, %d, %d]", (block == getFirstBlock(heap)) ? "\n" : ",\n",
+                                  offset, getBlockSize(block), list == -1, list);
+            writeMap(writer, record, length);
+        }
+    }
+    if (format == SF_HEAP_MAP_JSON) writeMap(writer, "]}", 2);
+}
+
+// -------------------------------------------------------------------------------------------------------------------------
+
+
+
+// Arenas ------------------------------------------------------------------------------------------------------------------
+// An arena keeps its chunks in a list, in the order it uses them in. The chunks before the current one are full, and the ones
+//      after it are spare: sf_arena_reset goes back to the first chunk, so that the others are reused in order.
+#define ARENA_MIN_CHUNK 1024
+#define ARENA_MAX_CHUNK (256 * 1024)
+
+typedef struct sf_arena_chunk {
+    struct sf_arena_chunk* next;
+    size_t size;                                    // Bytes of memory after this header
+} sf_arena_chunk;
+
+typedef struct sf_arena {
+    sf_arena_chunk* chunks;
+    sf_arena_chunk* current;                        // The chunk being allocated from, or NULL if there are no chunks yet
+    uintptr_t next;                                 // The first free byte of the current chunk
+    uintptr_t end;                                  // The end of the current chunk
+    size_t chunkSize;                               // Size of the next new chunk
+} sf_arena;
+
+// Allocate from the current chunk. Returns NULL if it does not have room.
+void* bumpAllocate(sf_arena* arena, size_t size, size_t align){
+    uintptr_t start = (arena->next + align - 1) & ~(uintptr_t)(align - 1);
+    if (arena->current == NULL || start < arena->next || start > arena->end || size > arena->end - start) return NULL;
+    arena->next = start + size;
+    return (void*)start;
+}
+
+void useChunk(sf_arena* arena, sf_arena_chunk* chunk){
+    arena->current = chunk;
+    arena->next = (uintptr_t)(chunk + 1);
+    arena->end = arena->next + chunk->size;
+}
+
+// Get a new chunk of at least size bytes from sf_malloc, and put it right after the current chunk, ahead of the spare ones.
+//      Returns NULL if there is no memory.
+sf_arena_chunk* addChunk(sf_arena* arena, size_t size){
+    if (size > SIZE_MAX - sizeof(sf_arena_chunk)){
+        setErrno(ENOMEM);
+        return NULL;
+    }
+    if (size < arena->chunkSize) size = arena->chunkSize;
+    sf_arena_chunk* chunk = sf_malloc(sizeof(sf_arena_chunk) + size);
+    if (chunk == NULL) return NULL;
+    chunk->size = size;
+    if (arena->current == NULL){
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    else{
+        chunk->next = arena->current->next;
+        arena->current->next = chunk;
+    }
+    if (arena->chunkSize < ARENA_MAX_CHUNK) arena->chunkSize = (arena->chunkSize < ARENA_MAX_CHUNK / 2) ? 2 * arena->chunkSize : ARENA_MAX_CHUNK;
+    return chunk;
+}
+
+// -------------------------------------------------------------------------------------------------------------------------
+
+
+
+// Object pools ------------------------------------------------------------------------------------------------------------
+// A pool allocates from its free list first, and then from the objects of its newest slab that were never used, so that a new
+//      slab does not need to be threaded onto the free list.
+#define POOL_SLAB_SIZE 4096
+#define POOL_MIN_OBJECTS 8                          // Objects per slab, at least
+
+typedef struct sf_pool_slab {
+    struct sf_pool_slab* next;
+} sf_pool_slab;
+
+typedef struct sf_pool {
+    size_t objectSize;                              // The size asked for, rounded up to the alignment
+    size_t align;
+    size_t slabObjects;                             // Objects per slab
+    sf_pool_slab* slabs;
+    void* freeList;                                 // Freed objects, each holding the address of the next one
+    uintptr_t next;                                 // The first object of the newest slab that was never used
+    uintptr_t end;                                  // The end of the objects of the newest slab
+} sf_pool;
+
+// Get a new slab from sf_malloc and make its objects the next ones to use. Returns -1 if there is no memory.
+int addSlab(sf_pool* pool){
+    sf_pool_slab* slab = sf_malloc(sizeof(sf_pool_slab) + pool->align - 1 + pool->slabObjects * pool->objectSize);
+    if (slab == NULL) return -1;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->next = ((uintptr_t)(slab + 1) + pool->align - 1) & ~(uintptr_t)(pool->align - 1);
+    pool->end = pool->next + pool->slabObjects * pool->objectSize;
+    return 0;
+}
+
+// -------------------------------------------------------------------------------------------------------------------------
+
+
+
+// Body of sf_calloc, called w/ the heap's lock held. Like heapMalloc, but also sets *cleanFrom to where the clean region of the
+//      heap started before the allocation. The heap is set up first, so that its initial boundary tags count as written to.
+void* heapCalloc(sf_heap* heap, size_t requiredBlockSize, void** cleanFrom){
+    if (heap->start == heap->end){
+        if (initHeap(heap) == -1) return NULL;
+    }
+    *cleanFrom = heap->cleanFrom;
+    return heapMalloc(heap, requiredBlockSize);
+}
+
+// The heap calls of sf_malloc, sf_memalign (whose arg points to the alignment), sf_calloc (whose arg is the cleanFrom of
+//      heapCalloc) and sf_malloc_batch, in the one form that lockedHeapAlloc takes
+typedef size_t (*heapAllocator)(sf_heap* heap, size_t requiredBlockSize, size_t count, void** out, void* arg);
+
+size_t heapMallocOne(sf_heap* heap, size_t requiredBlockSize, size_t count, void** out, void* arg){
+    *out = heapMalloc(heap, requiredBlockSize);
+    return *out != NULL;
+}
+
+size_t heapMemalignOne(sf_heap* heap, size_t requiredBlockSize, size_t count, void** out, void* arg){
+    *out = heapMemalign(heap, requiredBlockSize, *(size_t*)arg);
+    return *out != NULL;
+}
+
+size_t heapCallocOne(sf_heap* heap, size_t requiredBlockSize, size_t count, void** out, void* arg){
+    *out = heapCalloc(heap, requiredBlockSize, arg);
+    return *out != NULL;
+}
+
+size_t heapMallocMany(sf_heap* heap, size_t requiredBlockSize, size_t count, void** out, void* arg){
+    return heapMallocBatch(heap, requiredBlockSize, count, out);
+}
+
+// Allocate count blocks from the heap this thread is bound to, w/ the heap's lock held, and store their payloads in out. If
+//      there is no memory available, the blocks held in this thread's cache may be enough once they are coalesced, so the
+//      cache is flushed and the rest are tried once more. Sets sf_errno to ENOMEM if fewer than count blocks were allocated.
+//      Returns the number of blocks allocated.
+size_t lockedHeapAlloc(heapAllocator allocate, size_t requiredBlockSize, size_t count, void** out, void* arg){
+    sf_heap* heap = getThreadHeap();
+    pthread_mutex_lock(&heap->lock);
+    size_t done = allocate(heap, requiredBlockSize, count, out, arg);
+    pthread_mutex_unlock(&heap->lock);
+
+    if (done < count && flushThreadCache() > 0){
+        pthread_mutex_lock(&heap->lock);
+        done += allocate(heap, requiredBlockSize, count - done, out + done, arg);
+        pthread_mutex_unlock(&heap->lock);
+    }
+    if (done < count) setErrno(ENOMEM);
+    return done;
+}
+
+// Body of sf_malloc, which sf_realloc also uses to move a block w/o counting a call to sf_malloc
+void* mallocBlock(size_t size){
+    // Check if request size is 0. If so, return NULL without setting sf_errno.
+    if (size == 0){
+        return NULL;
+    }
+
+    // Determine the size of the block to be allocated by adding the header size, footer size, and the size of any necessary padding
+    //      to reach a size that is a multiple of 32 to maintain proper alignment.
+    size_t requiredBlockSize = getRequiredBlockSize(size);
+
+    // Huge requests get a mapping of their own
+    size_t threshold = __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED);
+    if (threshold > 0 && size >= threshold){
+        sf_block* mappedBlock = mapBlock(requiredBlockSize, 32);
+        if (mappedBlock == NULL){
+            setErrno(ENOMEM);
+            return NULL;
+        }
+        return mappedBlock->body.payload;
+    }
+
+    // Small requests are served from the thread cache when it has a block of the right size
+    if (requiredBlockSize <= TCACHE_MAX_BLOCK_SIZE){
+        sf_block* cachedBlock = takeFromThreadCache(requiredBlockSize);
+        if (cachedBlock != NULL) return cachedBlock->body.payload;
+    }
+
+    // Allocate from the heap this thread is bound to
+    void* pp = NULL;
+    lockedHeapAlloc(heapMallocOne, requiredBlockSize, 1, &pp, NULL);
+    return pp;
+}
+
+// Count a block that sf_malloc, sf_calloc or sf_memalign allocated (not a failed call), and pass it on to the profiler
+void* countedMalloc(void* pp, size_t size){
+    if (pp != NULL) countCalls(&threadStats.mallocs, 1);
+    return profiled(pp, size);
+}
+
+/*
+ * This is your implementation of sf_malloc. It acquires uninitialized memory that
+ * is aligned and padded properly for the underlying system.
+ *
+ * @param size The number of bytes requested to be allocated.
+ *
+ * @return If size is 0, then NULL is returned without setting sf_errno.
+ * If size is nonzero, then if the allocation is successful a pointer to a valid region of
+ * memory of the requested size is returned.  If the allocation is not successful, then
+ * NULL is returned and sf_errno is set to ENOMEM.
+ */
+
+void *sf_malloc(size_t size) {
+    return countedMalloc(mallocBlock(size), size);
+}
+
+// Zero the payload of a block that was just allocated from a heap whose clean region started at cleanFrom before the
+//      allocation. Only the part of the payload before cleanFrom, and its last word (which may have been the footer of the
+//      wilderness block), can hold anything but zeroes.
+void zeroPayload(void* pp, void* cleanFrom){
+    sf_block* block = (sf_block*)(pp - sizeof(sf_header));
+    void* payloadEnd = getNextBlock(block);
+    if (cleanFrom >= payloadEnd){
+        memset(pp, 0, payloadEnd - pp);
+        return;
+    }
+    if (cleanFrom > pp) memset(pp, 0, cleanFrom - pp);
+    *(uint64_t*)(payloadEnd - 8) = 0;
+}
+
+void *sf_calloc(size_t nmemb, size_t size){
+    if (nmemb != 0 && size > SIZE_MAX / nmemb){
+        setErrno(ENOMEM);
+        return NULL;
+    }
+    size_t totalSize = nmemb * size;
+    if (totalSize == 0){
+        return NULL;
+    }
+    size_t requiredBlockSize = getRequiredBlockSize(totalSize);
+
+    // Mapped blocks are fresh anonymous memory, which is zero already
+    size_t threshold = __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED);
+    if (threshold > 0 && totalSize >= threshold){
+        sf_block* mappedBlock = mapBlock(requiredBlockSize, 32);
+        if (mappedBlock == NULL){
+            setErrno(ENOMEM);
+            return NULL;
+        }
+        return countedMalloc(mappedBlock->body.payload, totalSize);
+    }
+
+    // Cached blocks have been used before
+    if (requiredBlockSize <= TCACHE_MAX_BLOCK_SIZE){
+        sf_block* cachedBlock = takeFromThreadCache(requiredBlockSize);
+        if (cachedBlock != NULL){
+            memset(cachedBlock->body.payload, 0, requiredBlockSize - sizeof(sf_header));
+            return countedMalloc(cachedBlock->body.payload, totalSize);
+        }
+    }
+
+    // Allocate from the heap this thread is bound to, and zero only what has been written to since the heap grew over it
+    void* pp = NULL;
+    void* cleanFrom;
+    if (lockedHeapAlloc(heapCallocOne, requiredBlockSize, 1, &pp, &cleanFrom) == 0) return NULL;
+    zeroPayload(pp, cleanFrom);
+    return countedMalloc(pp, totalSize);
+}
+
+void *sf_malloc_at_least(size_t size, size_t *actual){
+    void* pp = sf_malloc(size);
+    if (pp != NULL) *actual = getBlockSize((sf_block*)(pp - sizeof(sf_header))) - sizeof(sf_header);
+    return pp;
+}
+
+size_t sf_malloc_usable_size(void *pp){
+    if (pp == NULL){
+        return 0;
+    }
+    if (!mappedPointerIsValid(pp) && !pointerIsValid(pp)){
+        setErrno(EINVAL);
+        return 0;
+    }
+    // Allocated blocks have no footer, so the whole block but its header is payload
+    return getBlockSize((sf_block*)(pp - sizeof(sf_header))) - sizeof(sf_header);
+}
+
+size_t sf_malloc_batch(size_t size, size_t count, void **out){
+    if (size == 0 || count == 0){
+        return 0;
+    }
+    size_t requiredBlockSize = getRequiredBlockSize(size);
+    size_t done = 0;
+
+    // Huge blocks get a mapping each, as sf_malloc would give them
+    size_t threshold = __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED);
+    if (threshold > 0 && size >= threshold){
+        for (; done < count; done++){
+            sf_block* mappedBlock = mapBlock(requiredBlockSize, 32);
+            if (mappedBlock == NULL) break;
+            out[done] = mappedBlock->body.payload;
+        }
+        if (done < count) setErrno(ENOMEM);
+    }
+    else{
+        done = lockedHeapAlloc(heapMallocMany, requiredBlockSize, count, out, NULL);
+    }
+    countCalls(&threadStats.mallocs, done);
+    if (__atomic_load_n(&sampleRate, __ATOMIC_RELAXED) > 0){
+        for (size_t i=0; i<done; i++) profiled(out[i], size);
+    }
+    return done;
+}
+
+/*
+ * Marks a dynamically allocated region as no longer in use.
+ * Adds the newly freed block to the free list.
+ *
+ * @param ptr Address of memory returned by the function sf_malloc.
+ *
+ * If ptr is invalid, the function calls abort() to exit the program.
+ */
+
+void sf_free(void *pp) {
+    sf_block* block = (sf_block*)(pp - sizeof(sf_header));
+    countCalls(&threadStats.frees, 1);
+    // Mapped blocks are given straight back to the OS
+    if (mappedPointerIsValid(pp)){
+        if (readHeader(block) & SAMPLED_BLOCK) removeSample(block);
+        unmapBlock(block);
+        return;
+    }
+
+    if (!pointerIsValid(pp)) abort();
+    if (readHeader(block) & SAMPLED_BLOCK) removeSample(block);
+    freeHeapBlock(block);
+}
+
+void sf_free_sized(void *pp, size_t size){
+    sf_block* block = (sf_block*)(pp - sizeof(sf_header));
+    countCalls(&threadStats.frees, 1);
+
+#ifdef DEBUG
+    // The caller is trusted in release builds. Debug builds check the pointer, and that an allocation of the given size
+    //      could have returned this block.
+    int mapped = mappedPointerIsValid(pp);
+    if (!mapped && !pointerIsValid(pp)) abort();
+    size_t requiredBlockSize = getRequiredBlockSize(size);
+    if (requiredBlockSize > getBlockSize(block) || (!mapped && getBlockSize(block) - requiredBlockSize >= 32)){
+        error("sf_free_sized(%p, %zu): block size is %zu", pp, size, getBlockSize(block));
+        abort();
+    }
+#endif
+
+    if (readHeader(block) & SAMPLED_BLOCK) removeSample(block);
+    if (block->header & MAPPED_BLOCK){
+        unmapBlock(block);
+        return;
+    }
+    freeHeapBlock(block);
+}
+
+// Sort pointers by address. A quicksort w/ the comparison inlined, which is several times faster than qsort on pointers.
+void sortPointers(void** ptrs, size_t count){
+    while (count > 16){
+        // Median of three as the pivot, then partition around it
+        void* a = ptrs[0];
+        void* b = ptrs[count/2];
+        void* c = ptrs[count-1];
+        void* pivot = (a < b) ? ((b < c) ? b : ((a < c) ? c : a)) : ((a < c) ? a : ((b < c) ? c : b));
+        size_t i = 0;
+        size_t j = count - 1;
+        for (;;){
+            while (ptrs[i] < pivot) i++;
+            while (ptrs[j] > pivot) j--;
+            if (i >= j) break;
+            void* t = ptrs[i];
+            ptrs[i] = ptrs[j];
+            ptrs[j] = t;
+            i++;
+            j--;
+        }
+        // Recurse into the smaller part, and loop on the larger one
+        if (j + 1 < count - j - 1){
+            sortPointers(ptrs, j + 1);
+            ptrs += j + 1;
+            count -= j + 1;
+        }
+        else{
+            sortPointers(ptrs + j + 1, count - j - 1);
+            count = j + 1;
+        }
+    }
+    for (size_t i=1; i<count; i++){
+        void* p = ptrs[i];
+        size_t j = i;
+        while (j > 0 && ptrs[j-1] > p){
+            ptrs[j] = ptrs[j-1];
+            j--;
+        }
+        ptrs[j] = p;
+    }
+}
+
+void sf_free_batch(void **ptrs, size_t count){
+    countCalls(&threadStats.frees, count);
+    // Every pointer is checked before anything is freed, and sorting brings out pointers that were given twice
+    sortPointers(ptrs, count);
+    for (size_t i=0; i<count; i++){
+        if (!mappedPointerIsValid(ptrs[i]) && !pointerIsValid(ptrs[i])) abort();
+        if (i > 0 && ptrs[i] == ptrs[i-1]) abort();
+    }
+    for (size_t i=0; i<count; i++){
+        sf_block* block = (sf_block*)(ptrs[i] - sizeof(sf_header));
+        if (readHeader(block) & SAMPLED_BLOCK) removeSample(block);
+    }
+
+    sf_heap* ownHeap = getThreadHeap();
+    int locked = 0;
+    size_t i = 0;
+    while (i < count){
+        sf_block* block = (sf_block*)(ptrs[i] - sizeof(sf_header));
+        i++;
+        if (block->header & MAPPED_BLOCK){
+            unmapBlock(block);
+            continue;
+        }
+        sf_heap* heap = heapOf(block);
+        if (heap != ownHeap){
+            pushRemoteFree(heap, block);
+            continue;
+        }
+
+        // Join the run of blocks that follow this one in memory into one block, which is coalesced and inserted only once.
+        //      Each block joined counts as a coalesce, as it would if the blocks were freed one by one.
+        size_t runSize = getBlockSize(block);
+        size_t joined = 0;
+        while (i < count && ptrs[i] - sizeof(sf_header) == (void*)block + runSize){
+            runSize += getBlockSize((sf_block*)(ptrs[i] - sizeof(sf_header)));
+            joined++;
+            i++;
+        }
+        if (!locked){
+            pthread_mutex_lock(&ownHeap->lock);
+            locked = 1;
+        }
+        ownHeap->coalesces += joined;
+        block->header = runSize | THIS_BLOCK_ALLOCATED | (block->header & PREV_BLOCK_ALLOCATED);
+        freeBlock(ownHeap, block);
+    }
+    if (locked) pthread_mutex_unlock(&ownHeap->lock);
+}
+
+/*
+ * Resizes the memory pointed to by ptr to size bytes.
+ *
+ * @param ptr Address of the memory region to resize.
+ * @param size The minimum size to resize the memory to.
+ *
+ * @return If successful, the pointer to a valid region of memory is
+ * returned, else NULL is returned and sf_errno is set appropriately.
+ *
+ *   If sf_realloc is called with an invalid pointer sf_errno should be set to EINVAL.
+ *   If there is no memory available sf_realloc should set sf_errno to ENOMEM.
+ *
+ * If sf_realloc is called with a valid pointer and a size of 0 it should free
+ * the allocated block and return NULL without setting sf_errno.
+ */
+
+void *sf_realloc(void *pp, size_t rsize) {
+    sf_block* block = (sf_block*)(pp - sizeof(sf_header));
+    countCalls(&threadStats.reallocs, 1);
+    // The profiler counts a resize as a new allocation, which may or may not be sampled
+    if (mappedPointerIsValid(pp)){
+        if (readHeader(block) & SAMPLED_BLOCK) removeSample(block);
+        if (rsize == 0){
+            unmapBlock(block);
+            return NULL;
+        }
+        return profiled(reallocMappedBlock(block, rsize), rsize);
+    }
+
+    if (!pointerIsValid(pp)){
+        setErrno(EINVAL);
+        return NULL;
+    }
+    if (readHeader(block) & SAMPLED_BLOCK) removeSample(block);
+    if (rsize == 0){
+        freeHeapBlock(block);
+        return NULL;
+    }
+
+    size_t requiredBlockSize = getRequiredBlockSize(rsize);
+
+    // Return pointer to a valid region of memory
+    if (getBlockSize(block) == requiredBlockSize) return profiled(pp, rsize);
+
+    // If reallocating to a larger size, grow the block in place if the space after it is free. Otherwise, move it.
+    //      (sf_malloc sets sf_errno to ENOMEM if there is no memory available)
+    if (getBlockSize(block) < requiredBlockSize){
+        sf_heap* heap = heapOf(block);
+        pthread_mutex_lock(&heap->lock);
+        int grown = growBlockInPlace(heap, block, requiredBlockSize);
+        pthread_mutex_unlock(&heap->lock);
+        if (grown) return profiled(pp, rsize);
+
+        void* largerBlock = mallocBlock(rsize);
+        if (largerBlock == NULL) return NULL;
+        memcpy(largerBlock, pp, getBlockSize(block) - sizeof(sf_header));
+        freeHeapBlock(block);
+        return profiled(largerBlock, rsize);
+    }
+
+    // Reallocating to a smaller size
+    // Case with splinter: do nothing
+    // Case without splinter: split the block and free the remainder back into the heap that owns the block
+    if (!splitWillSplinter(block, requiredBlockSize)){
+        sf_heap* heap = heapOf(block);
+        pthread_mutex_lock(&heap->lock);
+        sf_block* remainderBlock = splitBlock(block, requiredBlockSize);
+        heap->splits++;
+        freeBlock(heap, remainderBlock);
+        pthread_mutex_unlock(&heap->lock);
+    }
+
+    return profiled(pp, rsize);
+}
+
+/*
  * Allocates a block of memory with a specified alignment.
  *
  * @param align The alignment required of the returned pointer.
@@ -667,5 +2309,348 @@ void *sf_realloc(void *pp, size_t rsize) {
  */
 
 void *sf_memalign(size_t size, size_t align) {
-    return NULL;
+    if (align < 32 || (align & (align - 1)) != 0){
+        setErrno(EINVAL);
+        return NULL;
+    }
+    if (size == 0){
+        return NULL;
+    }
+
+    // Every payload is 32-byte aligned already
+    if (align == 32) return countedMalloc(mallocBlock(size), size);
+
+    // Requests that would reach the mmap threshold once the room to align them is added get an aligned mapping of their own
+    size_t requiredBlockSize = getRequiredBlockSize(size);
+    size_t threshold = __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED);
+    if (threshold > 0 && (size >= threshold || threshold - size <= align - 32)){
+        sf_block* mappedBlock = mapBlock(requiredBlockSize, align);
+        if (mappedBlock == NULL){
+            setErrno(ENOMEM);
+            return NULL;
+        }
+        return countedMalloc(mappedBlock->body.payload, size);
+    }
+
+    void* pp = NULL;
+    lockedHeapAlloc(heapMemalignOne, requiredBlockSize, 1, &pp, &align);
+    return countedMalloc(pp, size);
+}
+
+int sf_posix_memalign(void **memptr, size_t align, size_t size){
+    if (align < sizeof(void*) || (align & (align - 1)) != 0) return EINVAL;
+    if (size == 0){
+        *memptr = NULL;
+        return 0;
+    }
+    void* pp = sf_memalign(size, (align < 32) ? 32 : align);
+    if (pp == NULL) return ENOMEM;
+    *memptr = pp;
+    return 0;
+}
+
+void *sf_aligned_alloc(size_t align, size_t size){
+    if (align == 0 || (align & (align - 1)) != 0){
+        setErrno(EINVAL);
+        return NULL;
+    }
+    return sf_memalign(size, (align < 32) ? 32 : align);
+}
+
+size_t sf_trim(size_t keep){
+    size_t released = 0;
+    int count = __atomic_load_n(&heapCount, __ATOMIC_ACQUIRE);
+    for (int i=0; i<count; i++){
+        sf_heap* heap = &heaps[i];
+        pthread_mutex_lock(&heap->lock);
+        if (heap->start != heap->end){
+            drainRemoteFrees(heap);
+            coalesceQuickLists(heap);
+            released += trimHeap(heap, keep);
+        }
+        pthread_mutex_unlock(&heap->lock);
+    }
+    return released;
+}
+
+void sf_get_stats(struct sf_stats *stats){
+    memset(stats, 0, sizeof(*stats));
+    size_t totalFree = 0;
+    int count = __atomic_load_n(&heapCount, __ATOMIC_ACQUIRE);
+    for (int i=0; i<count; i++){
+        sf_heap* heap = &heaps[i];
+        pthread_mutex_lock(&heap->lock);
+        stats->in_use += getHeapInUse(heap);
+        stats->peak_in_use += heap->peakInUse;
+        stats->heap_size += heap->end - heap->start;
+        for (int j=0; j<NUM_FREE_LISTS; j++){
+            stats->free_blocks[j] += heap->freeBlocks[j];
+            stats->free_bytes[j] += heap->freeBytes[j];
+        }
+        totalFree += heap->freeBytesTotal;
+        stats->growths += heap->growths;
+        stats->splits += heap->splits;
+        stats->coalesces += heap->coalesces;
+        size_t largest = getLargestFreeBlock(heap);
+        if (largest > stats->largest_free_block) stats->largest_free_block = largest;
+        pthread_mutex_unlock(&heap->lock);
+    }
+
+    size_t mapped = __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED);
+    stats->in_use += mapped;
+    stats->peak_in_use += __atomic_load_n(&peakMappedBytes, __ATOMIC_RELAXED);
+    stats->heap_size += mapped;
+    stats->mapped_blocks = __atomic_load_n(&mappedBlocks, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&threadStatsLock);
+    sf_thread_stats* counters = &threadStatsList;
+    do {
+        stats->mallocs += __atomic_load_n(&counters->mallocs, __ATOMIC_RELAXED);
+        stats->frees += __atomic_load_n(&counters->frees, __ATOMIC_RELAXED);
+        stats->reallocs += __atomic_load_n(&counters->reallocs, __ATOMIC_RELAXED);
+        counters = counters->next;
+    } while (counters != &threadStatsList);
+    pthread_mutex_unlock(&threadStatsLock);
+
+    if (totalFree > 0) stats->fragmentation = 1 - (double)stats->largest_free_block / totalFree;
+}
+
+int sf_mallopt(int option, long value){
+    switch (option){
+        case SF_OPT_TCACHE_COUNT:
+            if (value < 0 || value > SF_TCACHE_MAX_COUNT) break;
+            __atomic_store_n(&tcacheCount, (int)value, __ATOMIC_RELAXED);
+            return 0;
+        case SF_OPT_GROW_CHUNK:
+            if (value < PAGE_SZ || (size_t)value > SF_HEAP_SPAN) break;
+            __atomic_store_n(&growChunk, (size_t)value, __ATOMIC_RELAXED);
+            return 0;
+        case SF_OPT_MMAP_THRESHOLD:
+            if (value < 0) break;
+            __atomic_store_n(&mmapThreshold, (size_t)value, __ATOMIC_RELAXED);
+            return 0;
+        case SF_OPT_TRIM_THRESHOLD:
+            if (value < 0) break;
+            __atomic_store_n(&trimThreshold, (size_t)value, __ATOMIC_RELAXED);
+            return 0;
+        case SF_OPT_GROW_PERCENT:
+            if (value < 0 || value > SF_GROW_MAX_PERCENT) break;
+            __atomic_store_n(&growPercent, (int)value, __ATOMIC_RELAXED);
+            return 0;
+        case SF_OPT_SAMPLE_RATE:
+            if (value < 0) break;
+            __atomic_store_n(&sampleRate, (size_t)value, __ATOMIC_RELAXED);
+            return 0;
+        case SF_OPT_DEFER_COALESCING:
+            if (value < 0) break;
+            __atomic_store_n(&deferredCount, (size_t)value, __ATOMIC_RELAXED);
+            return 0;
+    }
+    setErrno(EINVAL);
+    return -1;
+}
+
+int sf_heap_profile_dump(int fd){
+    char line[64 + SAMPLE_MAX_FRAMES * 20];
+    int failed = 0;
+    pthread_mutex_lock(&samplesLock);
+    size_t liveBytes = 0;
+    for (size_t i=0; i<sampleCapacity; i++){
+        if (samples[i].pp != NULL && samples[i].pp != SAMPLE_REMOVED) liveBytes += samples[i].size;
+    }
+    // Only live samples are kept, so the totals of allocations ever made are given as the live ones
+    int length = snprintf(line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", sampleCount, liveBytes,
+                          sampleCount, liveBytes, __atomic_load_n(&sampleRate, __ATOMIC_RELAXED));
+    failed |= writeString(fd, line, length);
+    for (size_t i=0; i<sampleCapacity && !failed; i++){
+        sf_sample* sample = &samples[i];
+        if (sample->pp == NULL || sample->pp == SAMPLE_REMOVED) continue;
+        length = snprintf(line, sizeof(line), "1: %zu [1: %zu] @", sample->size, sample->size);
+        for (int j=0; j<sample->depth; j++){
+            length += snprintf(line + length, sizeof(line) - length, " %p", sample->stack[j]);
+        }
+        line[length++] = '\n';
+        failed |= writeString(fd, line, length);
+    }
+    pthread_mutex_unlock(&samplesLock);
+
+    // pprof needs the memory map to symbolize the stack traces
+    failed |= writeString(fd, "\nMAPPED_LIBRARIES:\n", 19);
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps == -1) return -1;
+    ssize_t got;
+    while (!failed && (got = read(maps, line, sizeof(line))) != 0){
+        if (got == -1 && errno == EINTR) continue;
+        if (got == -1) failed = -1;
+        else failed |= writeString(fd, line, got);
+    }
+    close(maps);
+    return failed ? -1 : 0;
+}
+
+int sf_heap_map_dump(int fd, int format){
+    if (format != SF_HEAP_MAP_BINARY && format != SF_HEAP_MAP_JSON){
+        setErrno(EINVAL);
+        return -1;
+    }
+    sf_map_writer writer;
+    writer.fd = fd;
+    writer.failed = 0;
+    writer.length = 0;
+
+    int count = __atomic_load_n(&heapCount, __ATOMIC_ACQUIRE);
+    if (format == SF_HEAP_MAP_BINARY){
+        struct sf_heap_map_header header = {SF_HEAP_MAP_MAGIC, SF_HEAP_MAP_VERSION, count};
+        writeMap(&writer, &header, sizeof(header));
+    }
+    else{
+        char record[64];
+        writeMap(&writer, record, snprintf(record, sizeof(record), "{\"version\": %d, \"heaps\": [\n", SF_HEAP_MAP_VERSION));
+    }
+    for (int i=0; i<count && writer.failed == 0; i++){
+        sf_heap* heap = &heaps[i];
+        pthread_mutex_lock(&heap->lock);
+        writeHeapMap(&writer, heap, i, format);
+        pthread_mutex_unlock(&heap->lock);
+    }
+    if (format == SF_HEAP_MAP_JSON) writeMap(&writer, "]}\n", 3);
+    flushMap(&writer);
+    return writer.failed;
+}
+
+struct sf_arena *sf_arena_create(size_t initial){
+    sf_arena* arena = sf_malloc(sizeof(sf_arena));
+    if (arena == NULL) return NULL;
+    arena->chunks = NULL;
+    arena->current = NULL;
+    arena->next = 0;
+    arena->end = 0;
+    arena->chunkSize = (initial > ARENA_MIN_CHUNK) ? initial : ARENA_MIN_CHUNK;
+    if (initial > 0){
+        sf_arena_chunk* chunk = addChunk(arena, initial);
+        if (chunk == NULL){
+            sf_free(arena);
+            return NULL;
+        }
+        useChunk(arena, chunk);
+    }
+    return arena;
+}
+
+void *sf_arena_alloc(struct sf_arena *arena, size_t size, size_t align){
+    if (align == 0) align = SF_ARENA_ALIGN;
+    if ((align & (align - 1)) != 0){
+        setErrno(EINVAL);
+        return NULL;
+    }
+    if (size == 0) return NULL;
+    void* pp = bumpAllocate(arena, size, align);
+    if (pp != NULL) return pp;
+
+    // Move on to the next spare chunk, or to a new one if there is none or it is too small. The new one is put ahead of the
+    //      spare chunks, so that they are still reused after the next reset.
+    if (size > SIZE_MAX - align){
+        setErrno(ENOMEM);
+        return NULL;
+    }
+    sf_arena_chunk* chunk = (arena->current != NULL) ? arena->current->next : NULL;
+    if (chunk == NULL || chunk->size < size + align - 1){
+        chunk = addChunk(arena, size + align - 1);
+        if (chunk == NULL) return NULL;
+    }
+    useChunk(arena, chunk);
+    return bumpAllocate(arena, size, align);
+}
+
+void sf_arena_reset(struct sf_arena *arena){
+    if (arena->chunks != NULL) useChunk(arena, arena->chunks);
+}
+
+void sf_arena_destroy(struct sf_arena *arena){
+    if (arena == NULL) return;
+    sf_arena_chunk* chunk = arena->chunks;
+    while (chunk != NULL){
+        sf_arena_chunk* next = chunk->next;
+        sf_free(chunk);
+        chunk = next;
+    }
+    sf_free(arena);
+}
+
+struct sf_pool *sf_pool_create(size_t obj_size, size_t align){
+    if (align == 0) align = (obj_size % 16 == 0) ? 16 : 8;
+    if (align < sizeof(void*)) align = sizeof(void*);
+    if (obj_size == 0 || (align & (align - 1)) != 0 || align > POOL_SLAB_SIZE){
+        setErrno(EINVAL);
+        return NULL;
+    }
+    if (obj_size > (SIZE_MAX - POOL_SLAB_SIZE) / POOL_MIN_OBJECTS){
+        setErrno(ENOMEM);
+        return NULL;
+    }
+    sf_pool* pool = sf_malloc(sizeof(sf_pool));
+    if (pool == NULL) return NULL;
+    pool->objectSize = (obj_size + align - 1) & ~(align - 1);
+    pool->align = align;
+    pool->slabObjects = POOL_SLAB_SIZE / pool->objectSize;
+    if (pool->slabObjects < POOL_MIN_OBJECTS) pool->slabObjects = POOL_MIN_OBJECTS;
+    pool->slabs = NULL;
+    pool->freeList = NULL;
+    pool->next = 0;
+    pool->end = 0;
+    return pool;
+}
+
+void *sf_pool_alloc(struct sf_pool *pool){
+    void* pp = pool->freeList;
+    if (pp != NULL){
+        pool->freeList = *(void**)pp;
+        return pp;
+    }
+    if (pool->next == pool->end && addSlab(pool) == -1) return NULL;
+    pp = (void*)pool->next;
+    pool->next += pool->objectSize;
+    return pp;
+}
+
+void sf_pool_free(struct sf_pool *pool, void *ptr){
+    if (ptr == NULL) return;
+    *(void**)ptr = pool->freeList;
+    pool->freeList = ptr;
+}
+
+void sf_pool_destroy(struct sf_pool *pool){
+    if (pool == NULL) return;
+    sf_pool_slab* slab = pool->slabs;
+    while (slab != NULL){
+        sf_pool_slab* next = slab->next;
+        sf_free(slab);
+        slab = next;
+    }
+    sf_free(pool);
+}
+
+void sf_fork_prepare(void){
+    // The heaps are set up first, so that no other thread is in the middle of it
+    pthread_once(&heapsOnce, initHeaps);
+    pthread_mutex_lock(&threadStatsLock);
+    pthread_mutex_lock(&samplesLock);
+    pthread_mutex_lock(&mappedLock);
+    for (int i=0; i<heapCount; i++){
+        pthread_mutex_lock(&heaps[i].lock);
+    }
+}
+
+void sf_fork_parent(void){
+    for (int i=heapCount-1; i>=0; i--){
+        pthread_mutex_unlock(&heaps[i].lock);
+    }
+    pthread_mutex_unlock(&mappedLock);
+    pthread_mutex_unlock(&samplesLock);
+    pthread_mutex_unlock(&threadStatsLock);
+}
+
+void sf_fork_child(void){
+    // Only the thread that forked exists in the child. It holds every lock, and the heaps are consistent.
+    sf_fork_parent();
 }
@@ -1,10 +1,18 @@
+#define _DEFAULT_SOURCE
 #include <criterion/criterion.h>
 #include <errno.h>
 #include <signal.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
 #include "debug.h"
 #include "sfmm.h"
+#include "sfmm_ext.h"
 #define TEST_TIMEOUT 15
 
+/* Where the clean region of the heap that contains p starts; internal to sfmm.c */
+void *getHeapCleanFrom(void *p);
+
 /*
  * Assert the total number of free blocks of a specified size.
  * If size == 0, then assert the total number of all free blocks.
@@ -127,7 +135,7 @@ Test(sfmm_basecode_suite, freelist, .timeout = TEST_TIMEOUT) {
 
 	assert_free_block_count(0, 4);
 	assert_free_block_count(224, 3);
-	assert_free_block_count(1760, 1);
+	assert_free_block_count(1792, 1);  // 500 bytes fit in 512 now that allocated blocks have no footer
 	assert_free_list_size(4, 3);
 	assert_free_list_size(7, 1);
 
@@ -227,3 +235,574 @@ Test(sfmm_student_suite, student_test_5, .timeout = TEST_TIMEOUT) {
 	sf_malloc(PAGE_SZ-32-32-32);
 	assert_free_list_size(7, 0);
 }
+
+static void *malloc_and_free_many(void *arg) {
+	void *blocks[32];
+	for(int round = 0; round < 100; round++) {
+		for(int i = 0; i < 32; i++) {
+			blocks[i] = sf_malloc(8 + i * 16);
+			if(blocks[i] == NULL)
+				return NULL;
+			memset(blocks[i], i, 8 + i * 16);
+		}
+		for(int i = 0; i < 32; i++)
+			sf_free(blocks[i]);
+	}
+	return arg;
+}
+
+// Tests that several threads can allocate at the same time, each from its own heap
+Test(sfmm_student_suite, student_test_6_threads, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_set_heap_count(4), 0, "sf_set_heap_count failed!");
+	pthread_t threads[8];
+	for(int i = 0; i < 8; i++)
+		pthread_create(&threads[i], NULL, malloc_and_free_many, (void *)1);
+	for(int i = 0; i < 8; i++) {
+		void *result;
+		pthread_join(threads[i], &result);
+		cr_assert_not_null(result, "A thread ran out of memory!");
+	}
+	cr_assert_eq(sf_set_heap_count(2), -1, "Heap count changed after the first allocation!");
+}
+
+static void *free_block(void *arg) {
+	sf_free(arg);
+	return NULL;
+}
+
+// Tests that a block freed by another thread goes back into the heap it was allocated from
+Test(sfmm_student_suite, student_test_7_remote_free, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(200);
+	/* void *y = */ sf_malloc(1);
+	pthread_t thread;
+	pthread_create(&thread, NULL, free_block, x);
+	pthread_join(thread, NULL);
+	assert_free_block_count(224, 1);
+	assert_free_list_size(4, 1);
+}
+
+// Tests that freed small blocks are kept in the thread cache, reused, and flushed when the cache overflows
+Test(sfmm_student_suite, student_test_8_thread_cache, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_mallopt(SF_OPT_TCACHE_COUNT, 2), 0, "sf_mallopt failed!");
+	void *x = sf_malloc(200);
+	/* void *y = */ sf_malloc(1);
+	sf_free(x);
+	assert_free_block_count(224, 0);
+	cr_assert_eq(sf_malloc(200), x, "Cached block was not reused!");
+
+	void *blocks[3];
+	for(int i = 0; i < 3; i++) {
+		blocks[i] = sf_malloc(100);
+		/* separator */ sf_malloc(1);
+	}
+	for(int i = 0; i < 3; i++)
+		sf_free(blocks[i]);
+	// The third free overflows the bin, so the two oldest blocks go back to the free lists
+	assert_free_block_count(128, 2);
+	cr_assert_eq(sf_malloc(100), blocks[2], "Most recently freed block was not reused!");
+}
+
+// Tests that a block freed by a thread bound to another heap waits in its heap's remote-free queue until the next allocation
+Test(sfmm_student_suite, student_test_9_remote_free_queue, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_set_heap_count(2), 0, "sf_set_heap_count failed!");
+	void *x = sf_malloc(200);
+	/* void *y = */ sf_malloc(1);
+	pthread_t thread;
+	pthread_create(&thread, NULL, free_block, x);
+	pthread_join(thread, NULL);
+	assert_free_block_count(224, 0);
+	cr_assert_eq(sf_malloc(200), x, "Remotely freed block was not reused!");
+}
+
+// Tests that large requests take the best fit from list 6, and the lowest block in memory among blocks of the same size
+Test(sfmm_student_suite, student_test_10_best_fit, .timeout = TEST_TIMEOUT) {
+	void *a = sf_malloc(600);
+	/* separator */ sf_malloc(1);
+	void *b = sf_malloc(600);
+	/* separator */ sf_malloc(1);
+	void *c = sf_malloc(1000);
+	/* separator */ sf_malloc(1);
+
+	sf_free(a);
+	sf_free(b);
+	sf_free(c);
+	assert_free_list_size(6, 3);
+
+	cr_assert_eq(sf_malloc(600), a, "Best fit was not chosen!");
+	cr_assert_eq(sf_malloc(500), b, "Best fit was not chosen!");
+	assert_free_block_count(1024, 1);
+}
+
+// Tests that allocated blocks have no footer, so that a 24-byte request fits in a 32-byte block, and that the header of the
+// next block tracks whether the block before it is allocated
+Test(sfmm_student_suite, student_test_11_footer_elision, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(24);
+	void *y = sf_malloc(24);
+	/* separator */ sf_malloc(1);
+	cr_assert_eq(y, (char *)x + 32, "24-byte request did not fit in a 32-byte block!");
+
+	sf_block *bp = (sf_block *)((char *)y - sizeof(sf_header));
+	cr_assert(bp->header & PREV_BLOCK_ALLOCATED, "Previous block should be marked allocated!");
+	sf_free(x);
+	cr_assert(!(bp->header & PREV_BLOCK_ALLOCATED), "Previous block should be marked free!");
+	sf_free(y);
+	assert_free_block_count(64, 1);
+}
+
+// Tests that the heap grows by the configured chunk, in one step, when the wilderness block is too small
+Test(sfmm_student_suite, student_test_12_grow_chunk, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_mallopt(SF_OPT_GROW_CHUNK, 4 * PAGE_SZ), 0, "sf_mallopt failed!");
+	void *x = sf_malloc(4000);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert_eq((char *)sf_mem_end() - (char *)sf_mem_start(), 5 * PAGE_SZ, "Heap did not grow by the chunk size!");
+	assert_free_block_count(6144, 1);
+	assert_free_list_size(7, 1);
+}
+
+// Tests that requests above the mmap threshold get a mapping of their own, which realloc resizes and free unmaps
+Test(sfmm_student_suite, student_test_13_mapped_blocks, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_mallopt(SF_OPT_MMAP_THRESHOLD, 64 * 1024), 0, "sf_mallopt failed!");
+	char *x = sf_malloc(PAGE_SZ * 100);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert(sf_mem_start() == sf_mem_end(), "Heap should not have grown!");
+	sf_block *bp = (sf_block *)(x - sizeof(sf_header));
+	cr_assert(bp->header & MAPPED_BLOCK, "Block should be marked as mapped!");
+
+	memset(x, 'a', PAGE_SZ * 100);
+	x = sf_realloc(x, PAGE_SZ * 1000);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert(x[0] == 'a' && x[PAGE_SZ * 100 - 1] == 'a', "Payload was not preserved!");
+
+	// Shrinking below the threshold moves the block into the heap
+	x = sf_realloc(x, 100);
+	cr_assert(x[0] == 'a' && x[99] == 'a', "Payload was not preserved!");
+	cr_assert(sf_mem_start() != sf_mem_end(), "Block should have moved into the heap!");
+	sf_free(x);
+	assert_free_block_count(1984, 1);
+}
+
+static void *trim_own_heap(void *arg) {
+	size_t *released = arg;
+	sf_free(sf_malloc(1 << 20));
+	released[0] = sf_trim(0);
+	released[1] = sf_trim(0);
+	// The heap grows again after being trimmed
+	void *x = sf_malloc(1 << 20);
+	released[2] = (x != NULL);
+	sf_free(x);
+	return NULL;
+}
+
+// Tests that sf_trim releases the wilderness block of a heap that lives in an mmap'ed region, and that the heap still works after
+Test(sfmm_student_suite, student_test_14_trim, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_set_heap_count(2), 0, "sf_set_heap_count failed!");
+	/* bind this thread to heap 0 */ sf_malloc(1);
+	size_t released[3];
+	pthread_t thread;
+	pthread_create(&thread, NULL, trim_own_heap, released);
+	pthread_join(thread, NULL);
+
+	cr_assert(released[0] >= (1 << 20) - PAGE_SZ, "Wilderness was not released! (released=%zu)", released[0]);
+	cr_assert_eq(released[1], 0, "Nothing should be left to release!");
+	cr_assert(released[2], "Heap did not grow again after being trimmed!");
+}
+
+// Tests that sf_realloc grows a block in place into the free block after it, and into the wilderness
+Test(sfmm_student_suite, student_test_15_realloc_in_place, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(100);
+	void *y = sf_malloc(200);
+	/* void *z = */ sf_malloc(1);
+	sf_free(y);
+	cr_assert_eq(sf_realloc(x, 250), x, "Block was not grown in place!");
+	assert_free_block_count(64, 1);
+
+	void *w = sf_malloc(100);
+	cr_assert_eq(sf_realloc(w, 4000), w, "Block was not grown into the wilderness!");
+	assert_free_list_size(7, 1);
+}
+
+// Tests that sf_memalign returns aligned blocks, and that the parts around them go back to the free lists
+Test(sfmm_student_suite, student_test_16_memalign, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert_null(sf_memalign(100, 48), "NULL should be returned!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+
+	void *x = sf_memalign(100, 64);
+	void *y = sf_memalign(3000, 4096);
+	void *z = NULL;
+	cr_assert_eq(sf_posix_memalign(&z, 1024, 200), 0, "sf_posix_memalign failed!");
+	cr_assert((uintptr_t)x % 64 == 0, "x is not aligned!");
+	cr_assert((uintptr_t)y % 4096 == 0, "y is not aligned!");
+	cr_assert((uintptr_t)z % 1024 == 0, "z is not aligned!");
+
+	sf_free(x);
+	sf_free(y);
+	sf_free(z);
+	assert_free_block_count(0, 1);
+	assert_free_list_size(7, 1);
+}
+
+// Tests that sf_calloc zeroes memory that has been used before, and checks for overflow
+Test(sfmm_student_suite, student_test_17_calloc, .timeout = TEST_TIMEOUT) {
+	char *x = sf_malloc(100);
+	memset(x, 0xff, 100);
+	sf_free(x);
+	char *y = sf_calloc(10, 10);
+	cr_assert_eq(y, x, "Freed block was not reused!");
+	for(int i = 0; i < 100; i++)
+		cr_assert_eq(y[i], 0, "Byte %d is not zero!", i);
+
+	sf_errno = 0;
+	cr_assert_null(sf_calloc(SIZE_MAX / 2, 4), "NULL should be returned!");
+	cr_assert(sf_errno == ENOMEM, "sf_errno is not ENOMEM!");
+}
+
+// Tests that sf_malloc_batch cuts adjacent blocks from one free block, and that sf_free_batch coalesces them back in any order
+Test(sfmm_student_suite, student_test_18_batch, .timeout = TEST_TIMEOUT) {
+	void *blocks[10];
+	cr_assert_eq(sf_malloc_batch(100, 10, blocks), 10, "Not every block was allocated!");
+	for(int i = 1; i < 10; i++)
+		cr_assert_eq(blocks[i], (char *)blocks[i - 1] + 128, "Blocks are not adjacent!");
+	assert_free_block_count(1984 - 10 * 128, 1);
+
+	void *reversed[10];
+	for(int i = 0; i < 10; i++)
+		reversed[i] = blocks[9 - i];
+	sf_free_batch(reversed, 10);
+	assert_free_block_count(1984, 1);
+	assert_free_list_size(7, 1);
+}
+
+// Tests that sf_free_sized frees and coalesces like sf_free
+Test(sfmm_student_suite, student_test_19_free_sized, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(100);
+	void *y = sf_malloc(100);
+	/* void *z = */ sf_malloc(1);
+	sf_free_sized(x, 100);
+	sf_free_sized(y, 100);
+	assert_free_block_count(256, 1);
+	assert_free_list_size(4, 1);
+}
+
+// Tests that the usable size of a block includes the slack left by rounding, and that the caller may fill it
+Test(sfmm_student_suite, student_test_20_usable_size, .timeout = TEST_TIMEOUT) {
+	size_t actual = 0;
+	char *x = sf_malloc_at_least(100, &actual);
+	cr_assert_eq(actual, 120, "Wrong usable size! (found=%zu)", actual);
+	cr_assert_eq(sf_malloc_usable_size(x), 120, "Wrong usable size!");
+	memset(x, 'a', actual);
+	char *y = sf_malloc(1);
+	cr_assert_eq(y, x + 128, "Slack was not in the same block!");
+	cr_assert_eq(sf_malloc_usable_size(NULL), 0, "NULL has no usable size!");
+	sf_free(x);
+	sf_free(y);
+	assert_free_block_count(1984, 1);
+}
+
+// Tests that sf_get_stats counts the calls, the blocks in use and the free blocks in each list
+Test(sfmm_student_suite, student_test_21_stats, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(100);
+	/* void *y = */ sf_malloc(100);
+	/* void *z = */ sf_malloc(1);
+	sf_free(x);
+
+	struct sf_stats stats;
+	sf_get_stats(&stats);
+	cr_assert_eq(stats.mallocs, 3, "Wrong number of mallocs! (found=%zu)", stats.mallocs);
+	cr_assert_eq(stats.frees, 1, "Wrong number of frees! (found=%zu)", stats.frees);
+	cr_assert_eq(stats.in_use, 160, "Wrong number of bytes in use! (found=%zu)", stats.in_use);
+	cr_assert_eq(stats.peak_in_use, 288, "Wrong peak! (found=%zu)", stats.peak_in_use);
+	cr_assert_eq(stats.heap_size, PAGE_SZ, "Wrong heap size! (found=%zu)", stats.heap_size);
+	cr_assert_eq(stats.growths, 1, "Wrong number of growths! (found=%zu)", stats.growths);
+	cr_assert_eq(stats.free_blocks[3], 1, "Wrong number of free blocks in list 3!");
+	cr_assert_eq(stats.free_bytes[3], 128, "Wrong number of free bytes in list 3!");
+	cr_assert_eq(stats.free_bytes[7], 1696, "Wrong size of the wilderness block!");
+	cr_assert_eq(stats.largest_free_block, 1696, "Wrong largest free block!");
+	cr_assert_float_eq(stats.fragmentation, 1 - 1696.0 / 1824, 1e-9, "Wrong fragmentation!");
+}
+
+// Tests that sampling every allocation puts the live ones, and only those, into the heap profile
+Test(sfmm_student_suite, student_test_22_heap_profile, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_mallopt(SF_OPT_SAMPLE_RATE, 1), 0, "Could not turn on the profiler!");
+	void *x = sf_malloc(100);
+	void *y = sf_malloc(200);
+	sf_header *header = (sf_header *)(x - sizeof(sf_header));
+	cr_assert(*header & SAMPLED_BLOCK, "Block was not sampled!");
+
+	char profile[256];
+	FILE *file = tmpfile();
+	cr_assert_eq(sf_heap_profile_dump(fileno(file)), 0, "Could not dump the profile!");
+	rewind(file);
+	cr_assert_not_null(fgets(profile, sizeof(profile), file), "Empty profile!");
+	cr_assert_str_eq(profile, "heap profile: 2: 300 [2: 300] @ heap_v2/1\n", "Wrong header! (found=%s)", profile);
+
+	fclose(file);
+
+	sf_free(x);
+	cr_assert_eq(*header & SAMPLED_BLOCK, 0, "Freed block is still sampled!");
+	file = tmpfile();
+	cr_assert_eq(sf_heap_profile_dump(fileno(file)), 0, "Could not dump the profile!");
+	rewind(file);
+	cr_assert_not_null(fgets(profile, sizeof(profile), file), "Empty profile!");
+	cr_assert_str_eq(profile, "heap profile: 1: 200 [1: 200] @ heap_v2/1\n", "Wrong header! (found=%s)", profile);
+	cr_assert_not_null(fgets(profile, sizeof(profile), file), "No sample!");
+	cr_assert_eq(strncmp(profile, "1: 200 [1: 200] @ 0x", 20), 0, "Wrong sample! (found=%s)", profile);
+	fclose(file);
+	sf_free(y);
+}
+
+// Tests that the heap map holds every block between the prologue and the epilogue, w/ its free list
+Test(sfmm_student_suite, student_test_23_heap_map, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(100);
+	/* void *y = */ sf_malloc(1);
+	sf_free(x);
+
+	FILE *file = tmpfile();
+	cr_assert_eq(sf_heap_map_dump(fileno(file), SF_HEAP_MAP_BINARY), 0, "Could not dump the heap map!");
+	rewind(file);
+	struct sf_heap_map_header header;
+	struct sf_heap_map_heap heap;
+	struct sf_heap_map_block blocks[3];
+	cr_assert_eq(fread(&header, sizeof(header), 1, file), 1, "No header!");
+	cr_assert_eq(header.magic, SF_HEAP_MAP_MAGIC, "Wrong magic number!");
+	cr_assert_eq(header.heaps, 1, "Wrong number of heaps! (found=%d)", header.heaps);
+	cr_assert_eq(fread(&heap, sizeof(heap), 1, file), 1, "No heap record!");
+	cr_assert_eq(heap.size, PAGE_SZ, "Wrong heap size!");
+	cr_assert_eq(heap.blocks, 3, "Wrong number of blocks! (found=%lu)", (unsigned long)heap.blocks);
+	cr_assert_eq(fread(blocks, sizeof(blocks[0]), 3, file), 3, "Missing block records!");
+	fclose(file);
+
+	cr_assert(blocks[0].offset == 56 && blocks[0].size == 128 && !blocks[0].allocated && blocks[0].list == 3,
+		  "Wrong record for the freed block!");
+	cr_assert(blocks[1].offset == 184 && blocks[1].size == 32 && blocks[1].allocated && blocks[1].list == -1,
+		  "Wrong record for the allocated block!");
+	cr_assert(blocks[2].offset == 216 && blocks[2].size == PAGE_SZ - 224 && blocks[2].list == NUM_FREE_LISTS - 1,
+		  "Wrong record for the wilderness block!");
+	cr_assert_eq(sf_heap_map_dump(fileno(stdout), 2), -1, "Format 2 is not valid!");
+	cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+}
+
+// Tests that deferred coalescing keeps freed blocks in quick lists, reuses them for the same size, and coalesces them on sf_trim
+Test(sfmm_student_suite, student_test_24_deferred_coalescing, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_mallopt(SF_OPT_DEFER_COALESCING, 8), 0, "Could not defer coalescing!");
+	void *x = sf_malloc(100);
+	void *y = sf_malloc(100);
+	/* void *z = */ sf_malloc(1);
+	sf_free(x);
+	sf_free(y);
+	assert_free_block_count(0, 1);
+	assert_free_list_size(NUM_FREE_LISTS - 1, 1);
+
+	void *w = sf_malloc(100);
+	cr_assert_eq(w, y, "Quick-listed block was not reused!");
+	sf_free(w);
+	sf_trim(PAGE_SZ);
+	assert_free_block_count(256, 1);
+	assert_free_list_size(4, 1);
+}
+
+// Tests that an arena bumps aligned allocations, and that after a reset it hands out the same memory w/o calling sf_malloc
+Test(sfmm_student_suite, student_test_25_arena, .timeout = TEST_TIMEOUT) {
+	struct sf_arena *arena = sf_arena_create(512);
+	cr_assert_not_null(arena, "Could not create an arena!");
+	char *x = sf_arena_alloc(arena, 10, 0);
+	char *y = sf_arena_alloc(arena, 24, 64);
+	char *z = sf_arena_alloc(arena, 1000, 0);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert_eq((uintptr_t)x % SF_ARENA_ALIGN, 0, "x is not aligned!");
+	cr_assert_eq((uintptr_t)y % 64, 0, "y is not aligned!");
+	cr_assert(y > x && y - x < 80, "y was not bumped from x!");
+	cr_assert_not_null(z, "z is NULL!");
+	cr_assert_null(sf_arena_alloc(arena, 8, 24), "Bad alignment was accepted!");
+	cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+
+	struct sf_stats before, after;
+	sf_get_stats(&before);
+	sf_arena_reset(arena);
+	cr_assert_eq(sf_arena_alloc(arena, 10, 0), x, "Reset did not rewind the arena!");
+	cr_assert_eq(sf_arena_alloc(arena, 24, 64), y, "Reset did not rewind the arena!");
+	cr_assert_eq(sf_arena_alloc(arena, 1000, 0), z, "Spare chunk was not reused!");
+	sf_get_stats(&after);
+	cr_assert_eq(after.mallocs, before.mallocs, "Reused arena called sf_malloc!");
+
+	sf_arena_destroy(arena);
+	assert_free_block_count(0, 1);
+	assert_free_list_size(NUM_FREE_LISTS - 1, 1);
+}
+
+// Tests that a pool packs objects back to back w/o headers, reuses freed ones first, and takes a slab per 85 48-byte objects
+Test(sfmm_student_suite, student_test_26_pool, .timeout = TEST_TIMEOUT) {
+	cr_assert_null(sf_pool_create(48, 24), "Bad alignment was accepted!");
+	cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+	struct sf_pool *pool = sf_pool_create(48, 0);
+	cr_assert_not_null(pool, "Could not create a pool!");
+	struct sf_stats before, after;
+	sf_get_stats(&before);
+	char *x = sf_pool_alloc(pool);
+	char *y = sf_pool_alloc(pool);
+	cr_assert_eq((uintptr_t)x % 16, 0, "x is not aligned!");
+	cr_assert_eq(y - x, 48, "Objects are not back to back!");
+
+	sf_pool_free(pool, x);
+	cr_assert_eq(sf_pool_alloc(pool), x, "Freed object was not reused!");
+	for (int i = 0; i < 200; i++) {
+		char *z = sf_pool_alloc(pool);
+		cr_assert_not_null(z, "z is NULL!");
+		memset(z, i, 48);
+	}
+	sf_get_stats(&after);
+	cr_assert_eq(after.mallocs - before.mallocs, 3, "200 objects did not take 3 slabs!");
+
+	sf_pool_destroy(pool);
+	assert_free_block_count(0, 1);
+	assert_free_list_size(NUM_FREE_LISTS - 1, 1);
+}
+
+static void free_on_exit(void *arg) {
+	sf_free(arg);
+}
+
+static void *free_now_and_on_exit(void *arg) {
+	void **blocks = arg;
+	pthread_key_t key;
+	sf_free(blocks[0]);
+	// Created after the thread cache's key, so its destructor runs after the cache is flushed
+	pthread_key_create(&key, free_on_exit);
+	pthread_setspecific(key, blocks[1]);
+	return NULL;
+}
+
+// Tests that a block freed by a thread-exit destructor that runs after the thread cache is flushed is not left in the cache
+Test(sfmm_student_suite, student_test_27_free_after_cache_exit, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_mallopt(SF_OPT_TCACHE_COUNT, 4), 0, "sf_mallopt failed!");
+	void *blocks[2];
+	blocks[0] = sf_malloc(200);
+	/* separator */ sf_malloc(1);
+	blocks[1] = sf_malloc(200);
+	/* separator */ sf_malloc(1);
+	pthread_t thread;
+	pthread_create(&thread, NULL, free_now_and_on_exit, blocks);
+	pthread_join(thread, NULL);
+	assert_free_block_count(224, 2);
+}
+
+// Tests that freeing a pointer that looks like a mapped block's payload, but points into memory that cannot be read, aborts
+Test(sfmm_student_suite, student_test_28_free_unmapped_pointer, .signal = SIGABRT, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_mallopt(SF_OPT_MMAP_THRESHOLD, 4096), 0, "sf_mallopt failed!");
+	cr_assert_not_null(sf_malloc(8192), "Could not map a block!");
+	char *page = mmap(NULL, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	cr_assert_neq(page, MAP_FAILED, "mmap failed!");
+	sf_free(page + 32);
+}
+
+// Tests that aligned requests that reach the mmap threshold get an aligned mapping of their own, even for alignments beyond a page
+Test(sfmm_student_suite, student_test_29_mapped_memalign, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_mallopt(SF_OPT_MMAP_THRESHOLD, 64 * 1024), 0, "sf_mallopt failed!");
+	char *x = sf_memalign(100, 2 << 20);
+	char *y = sf_memalign(64 * 1024, 256);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert_not_null(y, "y is NULL!");
+	cr_assert_eq((uintptr_t)x % (2 << 20), 0, "x is not aligned!");
+	cr_assert_eq((uintptr_t)y % 256, 0, "y is not aligned!");
+	cr_assert(sf_mem_start() == sf_mem_end(), "Heap should not have grown!");
+	cr_assert(((sf_block *)(x - sizeof(sf_header)))->header & MAPPED_BLOCK, "Block should be marked as mapped!");
+
+	memset(y, 'a', 64 * 1024);
+	y = sf_realloc(y, 640 * 1024);
+	cr_assert(y[0] == 'a' && y[64 * 1024 - 1] == 'a', "Payload was not preserved!");
+	struct sf_stats stats;
+	sf_get_stats(&stats);
+	cr_assert_eq(stats.mapped_blocks, 2, "There should be 2 mapped blocks!");
+	sf_free(x);
+	sf_free(y);
+	sf_get_stats(&stats);
+	cr_assert_eq(stats.mapped_blocks, 0, "Mapped blocks were not unmapped!");
+	cr_assert_eq(stats.heap_size, 0, "Mappings were not given back!");
+}
+
+// Tests that failed allocations are not counted, and that a batch free counts the coalesces of the blocks it joins
+Test(sfmm_student_suite, student_test_30_stats_counts, .timeout = TEST_TIMEOUT) {
+	struct sf_stats before, after;
+	sf_get_stats(&before);
+	cr_assert_null(sf_malloc(0), "sf_malloc(0) is not NULL!");
+	cr_assert_null(sf_malloc(1 << 20), "Heap 0 should not fit 1 MiB!");
+	void *blocks[4];
+	cr_assert_eq(sf_malloc_batch(100, 4, blocks), 4, "Batch allocation failed!");
+	/* separator */ sf_malloc(1);
+	sf_get_stats(&after);
+	cr_assert_eq(after.mallocs - before.mallocs, 5, "Only successful allocations should count!");
+
+	sf_free_batch(blocks, 4);
+	sf_get_stats(&after);
+	cr_assert_eq(after.coalesces - before.coalesces, 3, "Joined blocks should count as coalesces!");
+	assert_free_block_count(512, 1);
+}
+
+static void *malloc_block(void *arg) {
+	return sf_malloc((size_t)arg);
+}
+
+static char *next_block(char *pp) {
+	sf_block *bp = (sf_block *)(pp - sizeof(sf_header));
+	return (char *)bp + (bp->header & ~0x1f);
+}
+
+static void assert_zero(char *p, size_t size) {
+	for(size_t i = 0; i < size; i++)
+		cr_assert_eq(p[i], 0, "Byte %zu is not zero!", i);
+}
+
+// Tests that sf_calloc on an mmap'ed heap zeroes what was dirtied, and that the clean region follows allocations and trims
+Test(sfmm_student_suite, student_test_31_calloc_clean_region, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_set_heap_count(2), 0, "sf_set_heap_count failed!");
+	// The other thread takes heap 0, so this one allocates from heap 1
+	pthread_t thread;
+	pthread_create(&thread, NULL, malloc_block, (void *)1);
+	pthread_join(thread, NULL);
+
+	// Fresh memory: the clean region starts right after the links of the wilderness block
+	char *x = sf_calloc(1, 3000);
+	cr_assert((void *)x < sf_mem_start() || (void *)x >= sf_mem_end(), "x should not be in heap 0!");
+	assert_zero(x, 3000);
+	cr_assert_eq(getHeapCleanFrom(x), next_block(x) + 32, "Wrong clean region after the first calloc!");
+
+	// A dirty block coalesced back into the wilderness block stays out of the clean region
+	char *y = sf_malloc(3000);
+	char *dirty_until = next_block(y) + 32;
+	memset(y, 0xff, 3000);
+	sf_free(y);
+	cr_assert_eq(getHeapCleanFrom(x), dirty_until, "Wrong clean region after the free!");
+	cr_assert_eq(sf_calloc(3, 1000), y, "Freed block was not reused!");
+	assert_zero(y, 3000);
+	cr_assert_eq(getHeapCleanFrom(x), dirty_until, "Clean region moved for a block that was already dirty!");
+
+	// Trimming gives back the dirty pages, so the clean region starts at the new end of the heap
+	char *z = sf_malloc(20000);
+	memset(z, 0xff, 20000);
+	sf_free(z);
+	cr_assert(sf_trim(0) > 0, "Nothing was trimmed!");
+	char *clean_from = getHeapCleanFrom(x);
+	cr_assert(clean_from > z && clean_from < z + 20000, "Clean region did not move back to the new end!");
+	cr_assert_eq((uintptr_t)clean_from % 4096, 0, "Clean region does not start on a page!");
+	cr_assert_eq(sf_calloc(1, 20000), z, "Trimmed block was not reused!");
+	assert_zero(z, 20000);
+	cr_assert_eq(getHeapCleanFrom(x), next_block(z) + 32, "Wrong clean region after the last calloc!");
+}
+
+// Tests that sf_malloc_batch maps each block of at least the mmap threshold, and that sf_free_batch unmaps them
+Test(sfmm_student_suite, student_test_32_mapped_batch, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_mallopt(SF_OPT_MMAP_THRESHOLD, 64 * 1024), 0, "sf_mallopt failed!");
+	void *blocks[3];
+	cr_assert_eq(sf_malloc_batch(64 * 1024, 3, blocks), 3, "Not every block was allocated!");
+	cr_assert(sf_mem_start() == sf_mem_end(), "Heap should not have grown!");
+	for(int i = 0; i < 3; i++)
+		cr_assert(((sf_block *)((char *)blocks[i] - sizeof(sf_header)))->header & MAPPED_BLOCK,
+			  "Block %d should be marked as mapped!", i);
+	struct sf_stats stats;
+	sf_get_stats(&stats);
+	cr_assert_eq(stats.mapped_blocks, 3, "There should be 3 mapped blocks!");
+
+	sf_free_batch(blocks, 3);
+	sf_get_stats(&stats);
+	cr_assert_eq(stats.mapped_blocks, 0, "Mapped blocks were not unmapped!");
+}
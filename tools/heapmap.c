@@ -0,0 +1,175 @@
+/*
+ * Renders a heap map written by sf_heap_map_dump (in the binary format) as a fragmentation map and free-size histograms.
+ *
+ * Usage: sfmm_heapmap [-w width] [-r rows] [map]
+ *
+ * Reads the map from standard input if no file is given. For each heap, prints its utilization (bytes in allocated blocks
+ * / heap size), its largest free block and external fragmentation (1 - largest free block / free bytes), then:
+ *     - a map of the heap, rows lines of width cells, each cell standing for the same number of bytes:
+ *           '#' allocated   '+' mostly allocated   '-' mostly free   '.' free   ' ' padding, prologue or epilogue
+ *     - the number and total size of the free blocks in each power-of-two size class, and in each free list
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sfmm_ext.h"
+
+#define SIZE_CLASSES 40
+
+typedef struct {
+    size_t blocks;
+    size_t bytes;
+} free_count;
+
+static int readRecord(FILE* file, void* record, size_t size) {
+    if (fread(record, size, 1, file) == 1) return 0;
+    fprintf(stderr, "heap map is truncated\n");
+    return -1;
+}
+
+static void printBar(size_t value, size_t max, int width) {
+    int length = max ? (int)((double)value / max * width + 0.5) : 0;
+    if (length == 0 && value > 0) length = 1;
+    for (int i = 0; i < length; i++) putchar('*');
+}
+
+static void printMap(double* allocated, double* unallocated, size_t cells, size_t cellSize, int width) {
+    printf("\n  map (%zu bytes per cell)\n", cellSize);
+    for (size_t row = 0; row * width < cells; row++) {
+        printf("  %10zu |", row * width * cellSize);
+        for (size_t cell = row * width; cell < (row + 1) * width && cell < cells; cell++) {
+            if (allocated[cell] + unallocated[cell] == 0) putchar(' ');
+            else if (unallocated[cell] == 0) putchar('#');
+            else if (allocated[cell] == 0) putchar('.');
+            else putchar(allocated[cell] >= unallocated[cell] ? '+' : '-');
+        }
+        printf("|\n");
+    }
+}
+
+static void printHistograms(free_count* classes, free_count* lists) {
+    size_t maxBytes = 0;
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        if (classes[i].bytes > maxBytes) maxBytes = classes[i].bytes;
+    }
+    printf("\n  free blocks by size %17s %12s\n", "blocks", "bytes");
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        if (classes[i].blocks == 0) continue;
+        printf("  %12zu - %-12zu %8zu %12zu  ", (size_t)32 << i, ((size_t)64 << i) - 1, classes[i].blocks,
+               classes[i].bytes);
+        printBar(classes[i].bytes, maxBytes, 30);
+        putchar('\n');
+    }
+    printf("\n  free blocks by list %17s %12s\n", "blocks", "bytes");
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        printf("  %-27d %8zu %12zu\n", i, lists[i].blocks, lists[i].bytes);
+    }
+}
+
+// Read and render the map of one heap. Returns 0 on success, -1 if the map is not valid.
+static int renderHeap(FILE* file, int index, int width, int rows) {
+    struct sf_heap_map_heap heap;
+    if (readRecord(file, &heap, sizeof(heap)) == -1) return -1;
+
+    // Every cell stands for the same multiple of 32 bytes, so that the whole heap fits in the given rows
+    size_t cellSize = (heap.size + (size_t)width * rows - 1) / ((size_t)width * rows);
+    cellSize = (cellSize + 31) / 32 * 32;
+    if (cellSize == 0) cellSize = 32;
+    size_t cells = (heap.size + cellSize - 1) / cellSize;
+    double* allocated = calloc(cells + 1, sizeof(double));
+    double* unallocated = calloc(cells + 1, sizeof(double));
+    free_count classes[SIZE_CLASSES] = {{0, 0}};
+    free_count lists[NUM_FREE_LISTS] = {{0, 0}};
+    size_t allocatedBytes = 0;
+    size_t allocatedBlocks = 0;
+    size_t freeBytes = 0;
+    size_t largestFree = 0;
+
+    int status = 0;
+    for (uint64_t i = 0; i < heap.blocks; i++) {
+        struct sf_heap_map_block block;
+        if (readRecord(file, &block, sizeof(block)) == -1 || block.offset + block.size > heap.size ||
+            (!block.allocated && (block.list < 0 || block.list >= NUM_FREE_LISTS))) {
+            if (status == 0) fprintf(stderr, "heap %d: bad block record %lu\n", index, (unsigned long)i);
+            status = -1;
+            break;
+        }
+        // Spread the block over the cells it covers
+        double* counts = block.allocated ? allocated : unallocated;
+        size_t start = block.offset;
+        size_t end = block.offset + block.size;
+        while (start < end) {
+            size_t cellEnd = (start / cellSize + 1) * cellSize;
+            size_t stop = (cellEnd < end) ? cellEnd : end;
+            counts[start / cellSize] += stop - start;
+            start = stop;
+        }
+
+        if (block.allocated) {
+            allocatedBytes += block.size;
+            allocatedBlocks++;
+            continue;
+        }
+        int sizeClass = 0;
+        while (sizeClass < SIZE_CLASSES - 1 && ((size_t)64 << sizeClass) <= block.size) sizeClass++;
+        classes[sizeClass].blocks++;
+        classes[sizeClass].bytes += block.size;
+        lists[(int)block.list].blocks++;
+        lists[(int)block.list].bytes += block.size;
+        freeBytes += block.size;
+        if (block.size > largestFree) largestFree = block.size;
+    }
+
+    if (status == 0) {
+        printf("heap %d: %lu bytes, %lu blocks\n", index, (unsigned long)heap.size, (unsigned long)heap.blocks);
+        printf("  allocated %zu bytes in %zu blocks, utilization %.1f%%\n", allocatedBytes, allocatedBlocks,
+               heap.size ? 100.0 * allocatedBytes / heap.size : 0);
+        printf("  free %zu bytes in %zu blocks, largest %zu, fragmentation %.1f%%\n", freeBytes,
+               (size_t)heap.blocks - allocatedBlocks, largestFree,
+               freeBytes ? 100 * (1 - (double)largestFree / freeBytes) : 0);
+        if (heap.blocks > 0) {
+            printMap(allocated, unallocated, cells, cellSize, width);
+            printHistograms(classes, lists);
+        }
+        putchar('\n');
+    }
+    free(allocated);
+    free(unallocated);
+    return status;
+}
+
+int main(int argc, char** argv) {
+    int width = 64;
+    int rows = 16;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:r:")) != -1) {
+        if (opt == 'w') width = atoi(optarg);
+        else if (opt == 'r') rows = atoi(optarg);
+        else width = 0;
+    }
+    if (width < 1 || rows < 1 || argc - optind > 1) {
+        fprintf(stderr, "usage: %s [-w width] [-r rows] [map]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE* file = stdin;
+    if (optind < argc) {
+        file = fopen(argv[optind], "rb");
+        if (file == NULL) {
+            perror(argv[optind]);
+            return EXIT_FAILURE;
+        }
+    }
+    struct sf_heap_map_header header;
+    if (readRecord(file, &header, sizeof(header)) == -1) return EXIT_FAILURE;
+    if (header.magic != SF_HEAP_MAP_MAGIC || header.version != SF_HEAP_MAP_VERSION) {
+        fprintf(stderr, "not a binary heap map of version %d\n", SF_HEAP_MAP_VERSION);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < header.heaps; i++) {
+        if (renderHeap(file, i, width, rows) == -1) return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}